@@ -0,0 +1,374 @@
+/**
+ * Benchmark suite for buddy_malloc/calloc/realloc/free against the system
+ * malloc. Each workload runs once per allocator, in a child process of its own
+ * so that peak RSS and the allocator's state are not shared between runs:
+ *
+ *   churn     fixed 64-byte objects freed and reallocated in random slots
+ *   random    log-uniform sizes from 8 bytes to 64 KB, calloc for one in eight
+ *   prodcons  one thread allocates, another frees, through a ring of pointers
+ *   realloc   buffers grown by realloc in random steps up to 1 MB
+ *
+ * Sizes and slots come from a fixed-seed generator, so both allocators see the
+ * same sequence of requests on every run. Every 16th operation is timed on its
+ * own for the latency percentiles; the throughput figure includes that cost.
+ * Against a libbuddy built with OPTS=-DBUDDY_INSTRUMENT, the buddy rows are
+ * followed by the library's own percentiles of malloc and free cycles and of
+ * the splits and merges per call.
+ *
+ * Usage: buddy-bench [ops [workload ...]]
+ *
+ * @author Wyatt Cupp
+ *
+ */
+
+#include "buddy.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define DEFAULT_OPS 2000000
+#define SAMPLE_EVERY 16
+#define SLOTS 8192
+#define RING 1024
+#define POOL_SIZE ((size_t) 1 << 30)
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t);
+	void *(*calloc)(size_t, size_t);
+	void *(*realloc)(void *, size_t);
+	void (*free)(void *);
+};
+
+static const struct allocator allocators[] = {
+	{ "buddy", buddy_malloc, buddy_calloc, buddy_realloc, buddy_free },
+	{ "system", malloc, calloc, realloc, free },
+};
+
+/* latency samples of one run, in ns */
+struct samples {
+	uint32_t *ns;
+	size_t n, max;
+};
+
+static volatile unsigned long sink;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, so runs do not depend on the libc's rand() */
+static uint64_t next_rand(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * UINT64_C(2685821657736338717);
+}
+
+/* size in [lo, hi), uniform over its log2 */
+static size_t log_size(uint64_t *state, unsigned int lo_kval, unsigned int hi_kval) {
+	unsigned int k = lo_kval + next_rand(state) % (hi_kval - lo_kval);
+	size_t lo = (size_t) 1 << k;
+	return lo + next_rand(state) % lo;
+}
+
+static void samples_init(struct samples *s, size_t ops) {
+	s->max = ops / SAMPLE_EVERY + 1;
+	s->n = 0;
+	s->ns = malloc(s->max * sizeof(uint32_t));
+}
+
+static void sample(struct samples *s, uint64_t t0) {
+	if (s->n < s->max) {
+		s->ns[s->n++] = now_ns() - t0;
+	}
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct samples *s, double p) {
+	size_t i = (size_t) (p / 100.0 * s->n);
+	if (s->n == 0) {
+		return 0;
+	}
+	return s->ns[i < s->n ? i : s->n - 1];
+}
+
+
+/* one malloc or free per op on SLOTS slots of 64-byte objects */
+static size_t run_churn(const struct allocator *a, size_t ops, struct samples *lat) {
+	static void *slot[SLOTS];
+	uint64_t rng = 42;
+	size_t op, i;
+
+	for (op = 0; op < ops; op++) {
+		uint64_t t0 = (op % SAMPLE_EVERY) == 0 ? now_ns() : 0;
+
+		i = next_rand(&rng) % SLOTS;
+		if (slot[i] != NULL) {
+			a->free(slot[i]);
+			slot[i] = NULL;
+		} else {
+			slot[i] = a->malloc(64);
+			*(char *) slot[i] = (char) i;
+		}
+		if (t0 != 0) {
+			sample(lat, t0);
+		}
+	}
+	for (i = 0; i < SLOTS; i++) {
+		a->free(slot[i]);
+		slot[i] = NULL;
+	}
+	return ops;
+}
+
+
+/* like churn with sizes from 8 bytes to 64 KB; one allocation in eight is a calloc */
+static size_t run_random(const struct allocator *a, size_t ops, struct samples *lat) {
+	static void *slot[SLOTS];
+	uint64_t rng = 4242;
+	size_t op, i, size;
+
+	for (op = 0; op < ops; op++) {
+		uint64_t t0 = (op % SAMPLE_EVERY) == 0 ? now_ns() : 0;
+
+		i = next_rand(&rng) % SLOTS;
+		if (slot[i] != NULL) {
+			a->free(slot[i]);
+			slot[i] = NULL;
+		} else {
+			size = log_size(&rng, 3, 16);
+			slot[i] = (next_rand(&rng) & 7) == 0 ? a->calloc(1, size) : a->malloc(size);
+			*(char *) slot[i] = (char) i;
+		}
+		if (t0 != 0) {
+			sample(lat, t0);
+		}
+	}
+	for (i = 0; i < SLOTS; i++) {
+		a->free(slot[i]);
+		slot[i] = NULL;
+	}
+	return ops;
+}
+
+
+/* a single-producer single-consumer ring of pointers */
+struct ring {
+	void *slot[RING];
+	size_t head __attribute__((aligned(64))); // next slot the producer fills
+	size_t tail __attribute__((aligned(64))); // next slot the consumer empties
+	const struct allocator *a;
+	size_t ops;
+	struct samples lat;
+};
+
+static void *consumer(void *arg) {
+	struct ring *r = arg;
+	size_t done;
+
+	for (done = 0; done < r->ops; done++) {
+		void *ptr;
+		uint64_t t0;
+
+		while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+			sched_yield();
+		}
+		ptr = r->slot[r->tail % RING];
+		sink += *(char *) ptr;
+		t0 = (done % SAMPLE_EVERY) == 0 ? now_ns() : 0;
+		r->a->free(ptr);
+		if (t0 != 0) {
+			sample(&r->lat, t0);
+		}
+		__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* ops/2 objects of 16..512 bytes allocated by this thread and freed by another */
+static size_t run_prodcons(const struct allocator *a, size_t ops, struct samples *lat) {
+	static struct ring r;
+	pthread_t thread;
+	uint64_t rng = 424242;
+	size_t done, i;
+
+	r.a = a;
+	r.ops = ops / 2;
+	samples_init(&r.lat, r.ops);
+	pthread_create(&thread, NULL, consumer, &r);
+
+	for (done = 0; done < r.ops; done++) {
+		uint64_t t0;
+		void *ptr;
+
+		while (r.head - __atomic_load_n(&r.tail, __ATOMIC_ACQUIRE) == RING) {
+			sched_yield();
+		}
+		t0 = (done % SAMPLE_EVERY) == 0 ? now_ns() : 0;
+		ptr = a->malloc(log_size(&rng, 4, 9));
+		if (t0 != 0) {
+			sample(lat, t0);
+		}
+		*(char *) ptr = (char) done;
+		r.slot[r.head % RING] = ptr;
+		__atomic_store_n(&r.head, r.head + 1, __ATOMIC_RELEASE);
+	}
+	pthread_join(thread, NULL);
+
+	// the consumer's frees count towards the same percentiles
+	for (i = 0; i < r.lat.n && lat->n < lat->max; i++) {
+		lat->ns[lat->n++] = r.lat.ns[i];
+	}
+	free(r.lat.ns);
+	return 2 * r.ops;
+}
+
+
+/* 64 buffers, each grown from 16 bytes by random steps of up to 1/4 its size until 1 MB, then freed */
+static size_t run_realloc(const struct allocator *a, size_t ops, struct samples *lat) {
+	static void *buf[64];
+	static size_t len[64];
+	uint64_t rng = 42424242;
+	size_t op, i, size;
+
+	for (op = 0; op < ops; op++) {
+		uint64_t t0 = (op % SAMPLE_EVERY) == 0 ? now_ns() : 0;
+
+		i = next_rand(&rng) % 64;
+		if (len[i] >= ((size_t) 1 << 20)) {
+			a->free(buf[i]);
+			buf[i] = NULL;
+			len[i] = 0;
+		} else {
+			size = len[i] == 0 ? 16 : len[i] + 1 + next_rand(&rng) % (len[i] / 4 + 1);
+			buf[i] = a->realloc(buf[i], size);
+			((char *) buf[i])[size - 1] = (char) i;
+			len[i] = size;
+		}
+		if (t0 != 0) {
+			sample(lat, t0);
+		}
+	}
+	for (i = 0; i < 64; i++) {
+		a->free(buf[i]);
+		buf[i] = NULL;
+		len[i] = 0;
+	}
+	return ops;
+}
+
+
+struct workload {
+	const char *name;
+	size_t (*run)(const struct allocator *, size_t, struct samples *);
+};
+
+static const struct workload workloads[] = {
+	{ "churn", run_churn },
+	{ "random", run_random },
+	{ "prodcons", run_prodcons },
+	{ "realloc", run_realloc },
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+#define NALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+
+/* prints one of libbuddy's histograms under the row of its run */
+static void print_histogram(const char *name, const struct buddy_histogram *h) {
+	printf("  %-16s %12llu %7llu %7llu %7llu %8llu %9llu\n", name, h->count,
+		buddy_histogram_percentile(h, 50), buddy_histogram_percentile(h, 90),
+		buddy_histogram_percentile(h, 99), buddy_histogram_percentile(h, 99.9), h->max);
+}
+
+
+/* runs one workload in this (child) process and prints its row */
+static int bench(const struct workload *w, const struct allocator *a, size_t ops) {
+	struct samples lat;
+	struct rusage ru;
+	uint64_t t0, t1;
+	size_t done;
+
+	if (a->malloc == buddy_malloc && buddy_init_flags(POOL_SIZE, BUDDY_THREADSAFE|BUDDY_GROWABLE) != TRUE) {
+		fprintf(stderr, "buddy_init_flags failed\n");
+		return 1;
+	}
+
+	samples_init(&lat, ops);
+	t0 = now_ns();
+	done = w->run(a, ops, &lat);
+	t1 = now_ns();
+
+	qsort(lat.ns, lat.n, sizeof(uint32_t), cmp_u32);
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("%-9s %-7s %12.0f %7u %7u %7u %8u %9u %10ld\n", w->name, a->name,
+		done / ((t1 - t0) * 1e-9), percentile(&lat, 50), percentile(&lat, 90),
+		percentile(&lat, 99), percentile(&lat, 99.9), lat.n ? lat.ns[lat.n - 1] : 0,
+		ru.ru_maxrss);
+
+	if (a->malloc == buddy_malloc) {
+		static struct buddy_histograms h;
+
+		if (buddy_histograms_get(&h) == TRUE) {
+			print_histogram("malloc cycles", &h.malloc_cycles);
+			print_histogram("free cycles", &h.free_cycles);
+			print_histogram("malloc splits", &h.malloc_splits);
+			print_histogram("free merges", &h.free_merges);
+		}
+	}
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	size_t ops = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_OPS;
+	unsigned int w, i;
+	int a, status, failed = 0;
+
+	if (ops == 0) {
+		fprintf(stderr, "usage: %s [ops [workload ...]]\n", argv[0]);
+		return 2;
+	}
+
+	printf("%-9s %-7s %12s %7s %7s %7s %8s %9s %10s\n", "workload", "malloc", "ops/sec",
+		"p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "peak KB");
+
+	for (w = 0; w < NWORKLOADS; w++) {
+		// with names given, run only the named workloads
+		if (argc > 2) {
+			for (i = 2; i < (unsigned int) argc && strcmp(argv[i], workloads[w].name) != 0; i++) {
+				;
+			}
+			if (i == (unsigned int) argc) {
+				continue;
+			}
+		}
+
+		for (a = 0; a < (int) NALLOCATORS; a++) {
+			pid_t pid;
+
+			fflush(stdout);
+			pid = fork();
+			if (pid == 0) {
+				exit(bench(&workloads[w], &allocators[a], ops));
+			}
+			if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				fprintf(stderr, "%s/%s failed\n", workloads[w].name, allocators[a].name);
+				failed = 1;
+			}
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,234 @@
+/**
+ * Drop-in replacement for the C library's allocator on top of the default
+ * buddy arena, for running unmodified programs against libbuddy:
+ *
+ *   LD_PRELOAD=./libbuddy-malloc.so program
+ *
+ * The arena is created on the first call, thread-safe, growable and without
+ * block headers, so that a power-of-two request fills its block exactly and
+ * aligned requests cost no more than a large enough block. Calls made
+ * before the arena is ready, including any the initialization itself makes,
+ * are served from a static bootstrap buffer that is never reused. libbuddy's
+ * fork handlers keep the pools consistent across fork().
+ *
+ * @author Wyatt Cupp
+ *
+ */
+
+#define _GNU_SOURCE
+#include "buddy.h"
+#include <stdint.h>
+#include <sched.h>
+#include <malloc.h>
+
+#define POOL_SIZE ((size_t) 1 << 30)
+#define POOL_FLAGS (BUDDY_THREADSAFE|BUDDY_GROWABLE|BUDDY_NOHEADER)
+
+/*
+ * The alignment glibc gives every request. Slots of the pools' classes from 16
+ * bytes up are aligned to it, but those of the 8-byte class only to 8, so
+ * smaller requests are rounded up to it; see min_size.
+ */
+#define MIN_ALIGN 16
+
+#define BOOTSTRAP_SIZE (256*1024)
+
+/* states of the default arena */
+#define UNINITIALIZED 0
+#define INITIALIZING 1
+#define READY 2
+#define FAILED 3
+
+static int state = UNINITIALIZED;
+static __thread int initializing __attribute__((tls_model("initial-exec")));
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(MIN_ALIGN)));
+static size_t bootstrap_used;
+
+
+/**
+ * Carves size bytes aligned to align (at least MIN_ALIGN) off the bootstrap
+ * buffer, preceded by their size. The buffer starts zeroed and is never reused,
+ * so its memory is also good for calloc. Returns NULL once it runs out.
+ */
+static void *bootstrap_alloc(size_t size, size_t align) {
+	size_t used, start;
+
+	if (align < MIN_ALIGN) {
+		align = MIN_ALIGN;
+	}
+	do {
+		used = __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED);
+		start = (used + sizeof(size_t) + align - 1) & ~(align - 1);
+		if (start > BOOTSTRAP_SIZE || size > BOOTSTRAP_SIZE - start) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&bootstrap_used, &used, start + size, FALSE,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*(size_t *) (bootstrap + start - sizeof(size_t)) = size;
+	return bootstrap + start;
+}
+
+
+static int is_bootstrap(void *ptr) {
+	return (char *) ptr >= bootstrap && (char *) ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+
+static size_t bootstrap_size(void *ptr) {
+	return *(size_t *) ((char *) ptr - sizeof(size_t));
+}
+
+
+/* the size asked of the pools for a request of size bytes, so that it comes back aligned to MIN_ALIGN */
+static size_t min_size(size_t size) {
+	return size < MIN_ALIGN ? MIN_ALIGN : size;
+}
+
+
+/**
+ * Initializes the default arena on the first call. TRUE once it is ready;
+ * FALSE while the calling thread is initializing it, or if that failed, and the
+ * caller then falls back on the bootstrap buffer. Other threads wait for the
+ * initialization to finish.
+ */
+static int ready(void) {
+	int s = __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+
+	if (s == READY) {
+		return TRUE;
+	}
+	if (s == FAILED || initializing) {
+		return FALSE;
+	}
+
+	if (__atomic_compare_exchange_n(&state, &s, INITIALIZING, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		initializing = TRUE;
+		s = buddy_init_flags(POOL_SIZE, POOL_FLAGS) == TRUE ? READY : FAILED;
+		initializing = FALSE;
+		__atomic_store_n(&state, s, __ATOMIC_RELEASE);
+		return s == READY;
+	}
+
+	while ((s = __atomic_load_n(&state, __ATOMIC_ACQUIRE)) == INITIALIZING) {
+		sched_yield();
+	}
+	return s == READY;
+}
+
+
+void *malloc(size_t size) {
+	if (!ready()) {
+		return bootstrap_alloc(size, MIN_ALIGN);
+	}
+	return buddy_malloc(min_size(size));
+}
+
+
+void free(void *ptr) {
+	if (ptr == NULL || is_bootstrap(ptr)) {
+		return;
+	}
+	buddy_free(ptr);
+}
+
+
+/* C23; like free() for memory from malloc, calloc or realloc, whose size is known */
+void free_sized(void *ptr, size_t size) {
+	if (ptr == NULL || is_bootstrap(ptr)) {
+		return;
+	}
+	buddy_free_sized(ptr, min_size(size));
+}
+
+
+void *calloc(size_t nmemb, size_t size) {
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (!ready()) {
+		return bootstrap_alloc(nmemb * size, MIN_ALIGN);
+	}
+	return nmemb * size < MIN_ALIGN ? buddy_calloc(1, MIN_ALIGN) : buddy_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size) {
+	void *addr;
+
+	if (ptr == NULL || !is_bootstrap(ptr)) {
+		return ptr == NULL ? malloc(size) : buddy_realloc(ptr, size == 0 ? 0 : min_size(size));
+	}
+
+	// bootstrap memory moves to the pools
+	if (size == 0) {
+		return NULL;
+	}
+	addr = malloc(size);
+	if (addr != NULL) {
+		memcpy(addr, ptr, size < bootstrap_size(ptr) ? size : bootstrap_size(ptr));
+	}
+	return addr;
+}
+
+
+void *memalign(size_t align, size_t size) {
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!ready()) {
+		return bootstrap_alloc(size, align);
+	}
+	return buddy_memalign(align < MIN_ALIGN ? MIN_ALIGN : align, size);
+}
+
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+	void *ptr;
+
+	if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0 || align == 0) {
+		return EINVAL;
+	}
+	ptr = memalign(align, size);
+	if (ptr == NULL) {
+		return ENOMEM;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+
+void *aligned_alloc(size_t align, size_t size) {
+	return memalign(align, size);
+}
+
+
+void *valloc(size_t size) {
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+
+void *pvalloc(size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - page) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+
+size_t malloc_usable_size(void *ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+	if (is_bootstrap(ptr)) {
+		return bootstrap_size(ptr);
+	}
+	return buddy_usable_size(ptr);
+}
@@ -0,0 +1,408 @@
+/**
+ * Reads a pool map written by buddy_dump_map() and shows where the free
+ * memory is: a heatmap of the pool, the free blocks per order, and for each
+ * large order how far the pool is from having a free block of that size.
+ *
+ * The heatmap has a character per cell of the pool, by the share of the cell
+ * in use: ' ' none, '.' up to 1/4, ':' up to 1/2, '+' up to 3/4, '#' less
+ * than all, '@' all of it. Slabs count as in use, and so do blocks held in
+ * thread caches. With -p the same is written as a PGM image, a pixel per
+ * smaller cell, black for free memory and white for used.
+ *
+ * For each order k the table counts the aligned windows of 2^k bytes that are
+ * entirely free: a request for a block of 2^k succeeds only if there is one,
+ * however much memory is free in all. For the window closest to being free it
+ * gives the bytes in use and the blocks they are in, which are what keeps a
+ * large allocation from succeeding.
+ *
+ * Usage: buddy-mapview [-w width] [-h height] [-p image.pgm] map
+ *
+ * @author Wyatt Cupp
+ *
+ */
+
+#include "buddy.h"
+#include <stdint.h>
+
+#define HEADER_SIZE 24
+#define DEFAULT_WIDTH 64
+#define DEFAULT_HEIGHT 32
+#define IMAGE_WIDTH 512
+#define IMAGE_CELLS_KVAL 18 /* at most 2^18 pixels per chunk */
+#define WINDOW_ORDERS 20    /* orders below the chunk's order given windows */
+#define ORDERS 64
+
+struct map {
+	const unsigned char *data, *end;
+	unsigned int chunk_kval, min_kval, page_kval, flags, nchunks;
+	uint64_t start;
+};
+
+/* per order of window: bytes and blocks in use in each aligned window of a chunk */
+struct windows {
+	uint64_t *used;
+	uint32_t *blocks;
+	uint64_t n;
+};
+
+/* totals over the whole map */
+struct totals {
+	uint64_t free_blocks[ORDERS];
+	uint64_t lazy_blocks[ORDERS];
+	uint64_t reserved_blocks[ORDERS];
+	uint64_t slabs;
+	uint64_t whole_free[ORDERS]; // windows of 2^k bytes without a byte in use
+	uint64_t best_used[ORDERS];  // bytes in use in the least used window
+	uint64_t best_blocks[ORDERS];
+	uint64_t best_start[ORDERS]; // address of that window
+};
+
+static const char shades[] = " .:+#@";
+
+
+static uint64_t get_le(const unsigned char *p, unsigned int bytes) {
+	uint64_t v = 0;
+
+	while (bytes-- > 0) {
+		v = v << 8 | p[bytes];
+	}
+	return v;
+}
+
+/* LEB128; FALSE at the end of the data or on an overlong number */
+static int get_count(struct map *m, uint64_t *v) {
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (m->data < m->end && shift < 64) {
+		*v |= (uint64_t) (*m->data & 0x7f) << shift;
+		if ((*m->data++ & 0x80) == 0) {
+			return TRUE;
+		}
+		shift += 7;
+	}
+	return FALSE;
+}
+
+static unsigned char *read_file(const char *path, size_t *len) {
+	FILE *f = fopen(path, "rb");
+	unsigned char *buf = NULL;
+	size_t n = 0, max = 0;
+
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	for (;;) {
+		if (n == max) {
+			max = max ? 2 * max : 65536;
+			buf = realloc(buf, max);
+			if (buf == NULL) {
+				perror("realloc");
+				fclose(f);
+				return NULL;
+			}
+		}
+		size_t r = fread(buf + n, 1, max - n, f);
+		if (r == 0) {
+			break;
+		}
+		n += r;
+	}
+	if (ferror(f)) {
+		perror(path);
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	*len = n;
+	return buf;
+}
+
+static const char *human(uint64_t bytes, char *buf) {
+	const char *unit = "BKMGT";
+
+	while (bytes >= 1024 && (bytes & 1023) == 0 && unit[1] != '\0') {
+		bytes >>= 10;
+		unit++;
+	}
+	sprintf(buf, "%llu%c", (unsigned long long) bytes, *unit);
+	return buf;
+}
+
+
+/* counts a run of blocks of one state and order at offset in the windows of every order from lo up */
+static void add_run(struct windows *win, unsigned int lo, unsigned int hi, uint64_t offset,
+	unsigned int state, unsigned int kval, uint64_t count) {
+	uint64_t end = offset + (count << kval);
+	unsigned int k;
+
+	if (state == BUDDY_MAP_FREE || state == BUDDY_MAP_LAZY) {
+		return;
+	}
+	for (k = lo; k <= hi; k++) {
+		struct windows *w = &win[k];
+		uint64_t at = offset, next;
+
+		while (at < end) {
+			uint64_t i = at >> k;
+
+			next = (i + 1) << k;
+			if (next > end) {
+				next = end;
+			}
+			w->used[i] += next - at;
+			// blocks larger than the window fill it with one
+			w->blocks[i] += kval >= k ? 1 : (uint32_t) ((next - at) >> kval);
+			at = next;
+		}
+	}
+}
+
+static void draw(const struct windows *w, const struct map *m, unsigned int chunk, unsigned int kval,
+	unsigned int width) {
+	uint64_t i;
+
+	for (i = 0; i < w->n; i++) {
+		uint64_t size = UINT64_C(1) << kval;
+		int shade;
+
+		if (i % width == 0) {
+			printf("%s%16llx |", i ? "|\n" : "",
+				(unsigned long long) (m->start + ((uint64_t) chunk << m->chunk_kval) + (i << kval)));
+		}
+		if (w->used[i] == 0) {
+			shade = 0;
+		} else if (w->used[i] == size) {
+			shade = 5;
+		} else {
+			shade = 1 + (int) (4 * w->used[i] / size);
+			if (shade > 4) {
+				shade = 4;
+			}
+		}
+		putchar(shades[shade]);
+	}
+	printf("|\n");
+}
+
+
+int main(int argc, char *argv[]) {
+	unsigned int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT, lo, text_kval, image_kval, k, c;
+	struct windows win[ORDERS];
+	struct totals t;
+	struct map m;
+	const char *image = NULL;
+	unsigned char *buf;
+	FILE *pgm = NULL;
+	uint64_t free_bytes = 0, lazy_bytes = 0, used_bytes = 0, slab_bytes = 0, largest = 0, fits;
+	size_t len;
+	char b1[32], b2[32];
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-' && i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "-w") == 0 && (width = atoi(argv[i + 1])) > 0) {
+			;
+		} else if (strcmp(argv[i], "-h") == 0 && (height = atoi(argv[i + 1])) > 0) {
+			;
+		} else if (strcmp(argv[i], "-p") == 0) {
+			image = argv[i + 1];
+		} else {
+			break;
+		}
+	}
+	if (i != argc - 1) {
+		fprintf(stderr, "usage: %s [-w width] [-h height] [-p image.pgm] map\n", argv[0]);
+		return 2;
+	}
+
+	buf = read_file(argv[i], &len);
+	if (buf == NULL) {
+		return 1;
+	}
+	if (len < HEADER_SIZE || memcmp(buf, "BMAP", 4) != 0 || buf[4] != BUDDY_MAP_VERSION) {
+		fprintf(stderr, "%s: not a version %d buddy map\n", argv[i], BUDDY_MAP_VERSION);
+		return 1;
+	}
+	m.chunk_kval = buf[5];
+	m.min_kval = buf[6];
+	m.page_kval = buf[7];
+	m.flags = get_le(buf + 8, 4);
+	m.nchunks = get_le(buf + 12, 4);
+	m.start = get_le(buf + 16, 8);
+	m.data = buf + HEADER_SIZE;
+	m.end = buf + len;
+	if (m.chunk_kval >= ORDERS || m.min_kval > m.chunk_kval) {
+		fprintf(stderr, "%s: bad header\n", argv[i]);
+		return 1;
+	}
+
+	// the text map gets up to width x height cells over all chunks, whole lines for each chunk
+	for (text_kval = m.min_kval; text_kval < m.chunk_kval
+		&& (UINT64_C(1) << (m.chunk_kval - text_kval)) * m.nchunks > (uint64_t) width * height; text_kval++) {
+		;
+	}
+	if ((UINT64_C(1) << (m.chunk_kval - text_kval)) < width) {
+		width = 1 << (m.chunk_kval - text_kval);
+	}
+	image_kval = m.chunk_kval > IMAGE_CELLS_KVAL + m.min_kval ? m.chunk_kval - IMAGE_CELLS_KVAL : m.min_kval;
+	lo = m.chunk_kval > WINDOW_ORDERS + m.min_kval ? m.chunk_kval - WINDOW_ORDERS : m.min_kval;
+	if (text_kval < lo) {
+		lo = text_kval;
+	}
+	if (image != NULL && image_kval < lo) {
+		lo = image_kval;
+	}
+
+	memset(&t, 0, sizeof(t));
+	memset(win, 0, sizeof(win));
+	for (k = lo; k <= m.chunk_kval; k++) {
+		win[k].n = UINT64_C(1) << (m.chunk_kval - k);
+		win[k].used = malloc(win[k].n * sizeof(uint64_t));
+		win[k].blocks = malloc(win[k].n * sizeof(uint32_t));
+		if (win[k].used == NULL || win[k].blocks == NULL) {
+			perror("malloc");
+			return 1;
+		}
+		t.best_used[k] = UINT64_MAX;
+	}
+
+	if (image != NULL) {
+		uint64_t cells = (UINT64_C(1) << (m.chunk_kval - image_kval)) * m.nchunks;
+
+		pgm = fopen(image, "wb");
+		if (pgm == NULL) {
+			perror(image);
+			return 1;
+		}
+		fprintf(pgm, "P5\n%u %llu\n255\n", IMAGE_WIDTH,
+			(unsigned long long) ((cells + IMAGE_WIDTH - 1) / IMAGE_WIDTH));
+	}
+
+	printf("pool at %llx: %u chunk%s of %s, blocks of %s and up, flags 0x%x\n\n",
+		(unsigned long long) m.start, m.nchunks, m.nchunks == 1 ? "" : "s",
+		human(UINT64_C(1) << m.chunk_kval, b1), human(UINT64_C(1) << m.min_kval, b2), m.flags);
+
+	for (c = 0; c < m.nchunks; c++) {
+		uint64_t offset = 0, count, j, size = UINT64_C(1) << m.chunk_kval;
+		unsigned int chunk;
+
+		if (m.end - m.data < 4) {
+			fprintf(stderr, "%s: truncated\n", argv[i]);
+			return 1;
+		}
+		chunk = get_le(m.data, 4);
+		m.data += 4;
+		for (k = lo; k <= m.chunk_kval; k++) {
+			memset(win[k].used, 0, win[k].n * sizeof(uint64_t));
+			memset(win[k].blocks, 0, win[k].n * sizeof(uint32_t));
+		}
+
+		while (offset < size) {
+			unsigned int state, kval;
+
+			if (m.data == m.end) {
+				fprintf(stderr, "%s: truncated\n", argv[i]);
+				return 1;
+			}
+			state = *m.data >> 6;
+			kval = *m.data++ & 0x3f;
+			if (!get_count(&m, &count) || kval < m.min_kval || kval > m.chunk_kval
+				|| count == 0 || count > (size - offset) >> kval) {
+				fprintf(stderr, "%s: bad run at offset %llu of chunk %u\n", argv[i],
+					(unsigned long long) offset, chunk);
+				return 1;
+			}
+
+			switch (state) {
+			case BUDDY_MAP_FREE:
+				t.free_blocks[kval] += count;
+				free_bytes += count << kval;
+				break;
+			case BUDDY_MAP_LAZY:
+				t.lazy_blocks[kval] += count;
+				lazy_bytes += count << kval;
+				break;
+			case BUDDY_MAP_SLAB:
+				t.slabs += count;
+				slab_bytes += count << kval;
+				break;
+			default:
+				t.reserved_blocks[kval] += count;
+				used_bytes += count << kval;
+			}
+			if ((state == BUDDY_MAP_FREE || state == BUDDY_MAP_LAZY) && (UINT64_C(1) << kval) > largest) {
+				largest = UINT64_C(1) << kval;
+			}
+			add_run(win, lo, m.chunk_kval, offset, state, kval, count);
+			offset += count << kval;
+		}
+
+		for (k = lo; k <= m.chunk_kval; k++) {
+			for (j = 0; j < win[k].n; j++) {
+				if (win[k].used[j] == 0) {
+					t.whole_free[k]++;
+				}
+				if (win[k].used[j] < t.best_used[k]) {
+					t.best_used[k] = win[k].used[j];
+					t.best_blocks[k] = win[k].blocks[j];
+					t.best_start[k] = m.start + ((uint64_t) chunk << m.chunk_kval) + (j << k);
+				}
+			}
+		}
+
+		printf("chunk %u, a cell per %s:\n", chunk, human(UINT64_C(1) << text_kval, b1));
+		draw(&win[text_kval], &m, chunk, text_kval, width);
+		printf("\n");
+
+		if (pgm != NULL) {
+			for (j = 0; j < win[image_kval].n; j++) {
+				fputc((int) (255 * win[image_kval].used[j] >> image_kval), pgm);
+			}
+		}
+	}
+	if (pgm != NULL) {
+		uint64_t cells = (UINT64_C(1) << (m.chunk_kval - image_kval)) * m.nchunks;
+
+		for (; cells % IMAGE_WIDTH != 0; cells++) {
+			fputc(0, pgm);
+		}
+		if (fclose(pgm) != 0) {
+			perror(image);
+			return 1;
+		}
+	}
+
+	printf("%6s %8s %12s %12s %12s %14s %14s %10s %18s\n", "order", "size", "free", "lazy",
+		"reserved", "windows free", "least used KB", "in blocks", "at");
+	for (k = m.min_kval; k <= m.chunk_kval; k++) {
+		if (k < lo && t.free_blocks[k] == 0 && t.lazy_blocks[k] == 0 && t.reserved_blocks[k] == 0) {
+			continue;
+		}
+		printf("%6u %8s %12llu %12llu %12llu", k, human(UINT64_C(1) << k, b1),
+			(unsigned long long) t.free_blocks[k], (unsigned long long) t.lazy_blocks[k],
+			(unsigned long long) t.reserved_blocks[k]);
+		if (k >= lo) {
+			printf(" %14llu %14llu %10llu %18llx", (unsigned long long) t.whole_free[k],
+				(unsigned long long) (t.best_used[k] + 1023) >> 10, (unsigned long long) t.best_blocks[k],
+				(unsigned long long) t.best_start[k]);
+		}
+		printf("\n");
+	}
+
+	printf("\n%llu slabs; %llu KB free in blocks, %llu KB free but not merged, %llu KB in use, %llu KB in slabs\n",
+		(unsigned long long) t.slabs, (unsigned long long) free_bytes >> 10,
+		(unsigned long long) lazy_bytes >> 10, (unsigned long long) used_bytes >> 10,
+		(unsigned long long) slab_bytes >> 10);
+	// free but unmerged blocks merge on demand, so a whole free window serves a request even if it is in pieces
+	for (k = m.chunk_kval; k > lo && t.whole_free[k] == 0; k--) {
+		;
+	}
+	fits = t.whole_free[k] != 0 && (UINT64_C(1) << k) > largest ? UINT64_C(1) << k : largest;
+	printf("largest free block %s, largest block a request can get %s, external fragmentation %.2f%%\n",
+		human(largest, b1), human(fits, b2),
+		free_bytes + lazy_bytes ? 100.0 * (1.0 - (double) fits / (free_bytes + lazy_bytes)) : 0.0);
+
+	free(buf);
+	return 0;
+}
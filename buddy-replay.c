@@ -0,0 +1,435 @@
+/**
+ * Replays a recorded allocation trace against buddy_malloc and friends, or
+ * against the system malloc for comparison, and reports per-call latency
+ * histograms, internal fragmentation and footprint over time, and the peak
+ * footprint. With buddy_malloc the pool's free memory and its external
+ * fragmentation (the share of free memory outside the largest free block) are
+ * reported over time as well, and buddy_stats()'s counters at the end; -m
+ * writes the pool's map as left by the trace, for buddy-mapview.
+ *
+ * A trace is the 4 bytes "BTR1" followed by one record per call: an op byte
+ * and its operands as LEB128 varints. Objects are named by ids chosen by the
+ * recorder; an id is live from the call that returns it until it is freed.
+ *
+ *   'm' id size           ptr[id] = malloc(size)
+ *   'c' id nmemb size     ptr[id] = calloc(nmemb, size)
+ *   'r' old new size      ptr[new] = realloc(ptr[old], size); old 0 is NULL
+ *   'f' id                free(ptr[id])
+ *
+ * Id 0 stands for NULL. The same records, one per line with the op letter and
+ * decimal operands separated by spaces, form the text format that -c converts.
+ *
+ * Every page of a new object is written once, outside the timed call, so that
+ * the footprint is that of a program using its memory.
+ *
+ * Usage: buddy-replay [-s] [-i interval] [-m map] trace
+ *        buddy-replay -c text-trace trace
+ *
+ * @author Wyatt Cupp
+ *
+ */
+
+#include "buddy.h"
+#include <stdint.h>
+#include <time.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#define TRACE_MAGIC "BTR1"
+#define DEFAULT_INTERVAL 100000
+#define POOL_SIZE ((size_t) 1 << 30)
+#define HIST_BUCKETS 32 /* log2 buckets of ns: [2^i, 2^(i+1)) */
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t);
+	void *(*calloc)(size_t, size_t);
+	void *(*realloc)(void *, size_t);
+	void (*free)(void *);
+	size_t (*usable_size)(void *);
+};
+
+static size_t system_usable_size(void *ptr) {
+	return malloc_usable_size(ptr);
+}
+
+static const struct allocator buddy = {
+	"buddy", buddy_malloc, buddy_calloc, buddy_realloc, buddy_free, buddy_usable_size
+};
+static const struct allocator sys = {
+	"system", malloc, calloc, realloc, free, system_usable_size
+};
+
+/* a live object: its pointer and the size it was requested with */
+struct object {
+	void *ptr;
+	size_t size;
+};
+
+/* latency histogram of one call type */
+struct histogram {
+	const char *name;
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(struct histogram *h, uint64_t ns) {
+	unsigned int i = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+
+	h->count++;
+	h->total_ns += ns;
+	h->bucket[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+}
+
+static void print_histogram(const struct histogram *h) {
+	uint64_t most = 0;
+	int i, lo = HIST_BUCKETS, hi = -1;
+
+	if (h->count == 0) {
+		return;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (h->bucket[i] != 0) {
+			lo = i < lo ? i : lo;
+			hi = i;
+			most = h->bucket[i] > most ? h->bucket[i] : most;
+		}
+	}
+
+	printf("\n%s: %llu calls, mean %.1f ns\n", h->name, (unsigned long long) h->count,
+		(double) h->total_ns / h->count);
+	for (i = lo; i <= hi; i++) {
+		int bar = (int) (h->bucket[i] * 50 / most);
+
+		printf("  %10llu ns %10llu %6.2f%% %.*s\n", 1ULL << i, (unsigned long long) h->bucket[i],
+			100.0 * h->bucket[i] / h->count, bar, "##################################################");
+	}
+}
+
+/* writes a byte on each page of a new object, as the program that made the trace would have */
+static void touch(char *ptr, size_t size) {
+	size_t i;
+
+	for (i = 0; i < size; i += 4096) {
+		ptr[i] = 1;
+	}
+	if (size > 0) {
+		ptr[size - 1] = 1;
+	}
+}
+
+/* resident set size now, in KB */
+static long rss_kb(void) {
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f != NULL) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+static int read_varint(FILE *f, uint64_t *v) {
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		if ((c = getc(f)) == EOF || shift > 63) {
+			return FALSE;
+		}
+		*v |= (uint64_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return TRUE;
+}
+
+static void write_varint(FILE *f, uint64_t v) {
+	while (v >= 0x80) {
+		putc((int) (v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	putc((int) v, f);
+}
+
+/* number of operands of op, or 0 for an unknown op */
+static int operands(int op) {
+	switch (op) {
+	case 'm':
+		return 2;
+	case 'c':
+	case 'r':
+		return 3;
+	case 'f':
+		return 1;
+	}
+	return 0;
+}
+
+
+/* text trace to binary trace */
+static int convert(const char *in, const char *out) {
+	FILE *fin = fopen(in, "r"), *fout;
+	char line[256], op;
+	unsigned long long arg[3];
+	long lineno = 0;
+	int n;
+
+	if (fin == NULL) {
+		perror(in);
+		return 1;
+	}
+	if ((fout = fopen(out, "wb")) == NULL) {
+		perror(out);
+		fclose(fin);
+		return 1;
+	}
+
+	fputs(TRACE_MAGIC, fout);
+	while (fgets(line, sizeof(line), fin) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		n = sscanf(line, " %c %llu %llu %llu", &op, &arg[0], &arg[1], &arg[2]);
+		if (operands(op) == 0 || n != operands(op) + 1) {
+			fprintf(stderr, "%s:%ld: bad record\n", in, lineno);
+			fclose(fin);
+			fclose(fout);
+			return 1;
+		}
+		putc(op, fout);
+		for (n = 0; n < operands(op); n++) {
+			write_varint(fout, arg[n]);
+		}
+	}
+
+	fclose(fin);
+	return fclose(fout) == 0 ? 0 : 1;
+}
+
+
+/* makes room for ids up to id */
+static int ensure(struct object **objs, size_t *nobjs, uint64_t id) {
+	size_t n = *nobjs;
+
+	if (id < n) {
+		return TRUE;
+	}
+	while (n <= id) {
+		n = n ? 2 * n : 4096;
+	}
+	*objs = realloc(*objs, n * sizeof(struct object));
+	if (*objs == NULL) {
+		return FALSE;
+	}
+	memset(*objs + *nobjs, 0, (n - *nobjs) * sizeof(struct object));
+	*nobjs = n;
+	return TRUE;
+}
+
+
+static int replay(const char *path, const struct allocator *a, unsigned long interval, const char *map) {
+	struct histogram hist[4] = { { "malloc" }, { "calloc" }, { "realloc" }, { "free" } };
+	struct object *objs = NULL;
+	size_t nobjs = 0;
+	uint64_t arg[3], events = 0, t0;
+	size_t requested = 0, usable = 0, peak_requested = 0, peak_usable = 0;
+	long rss, peak_rss = 0, base_rss;
+	struct buddy_stats st;
+	char magic[4];
+	struct rusage ru;
+	FILE *f = fopen(path, "rb");
+	int op, i, ret = 1;
+
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+	if (fread(magic, 1, 4, f) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		goto out;
+	}
+	if (a == &buddy && buddy_init_flags(POOL_SIZE, BUDDY_GROWABLE) != TRUE) {
+		fprintf(stderr, "buddy_init_flags failed\n");
+		goto out;
+	}
+
+	base_rss = rss_kb();
+	printf("replaying %s with %s malloc\n\n", path, a->name);
+	printf("%12s %14s %14s %8s %10s %10s", "events", "requested KB", "usable KB",
+		"int frag", "RSS KB", "RSS/req");
+	if (a == &buddy) {
+		printf(" %12s %8s", "pool free KB", "ext frag");
+	}
+	printf("\n");
+
+	while ((op = getc(f)) != EOF) {
+		struct object *o;
+		size_t old_usable;
+		void *ptr;
+
+		if (operands(op) == 0) {
+			fprintf(stderr, "%s: bad op 0x%02x after %llu events\n", path, op, (unsigned long long) events);
+			goto out;
+		}
+		for (i = 0; i < operands(op); i++) {
+			if (!read_varint(f, &arg[i])) {
+				fprintf(stderr, "%s: truncated after %llu events\n", path, (unsigned long long) events);
+				goto out;
+			}
+		}
+		// realloc names two objects; the new one is the one that must fit
+		if (!ensure(&objs, &nobjs, arg[0]) || (op == 'r' && !ensure(&objs, &nobjs, arg[1]))) {
+			fprintf(stderr, "out of memory for %llu ids\n", (unsigned long long) arg[0]);
+			goto out;
+		}
+
+		switch (op) {
+		case 'm':
+			t0 = now_ns();
+			ptr = a->malloc(arg[1]);
+			record(&hist[0], now_ns() - t0);
+			o = &objs[arg[0]];
+			break;
+		case 'c':
+			t0 = now_ns();
+			ptr = a->calloc(arg[1], arg[2]);
+			record(&hist[1], now_ns() - t0);
+			o = &objs[arg[0]];
+			arg[1] *= arg[2];
+			break;
+		case 'r':
+			o = &objs[arg[0]];
+			old_usable = arg[0] != 0 && o->ptr ? a->usable_size(o->ptr) : 0;
+			t0 = now_ns();
+			ptr = a->realloc(arg[0] ? o->ptr : NULL, arg[2]);
+			record(&hist[2], now_ns() - t0);
+			// a failed realloc leaves the old object where it was
+			if (arg[0] != 0 && (ptr != NULL || arg[2] == 0)) {
+				requested -= o->size;
+				usable -= old_usable;
+				o->ptr = NULL;
+				o->size = 0;
+			}
+			o = &objs[arg[1]];
+			arg[1] = arg[2];
+			break;
+		default:
+			o = &objs[arg[0]];
+			requested -= o->size;
+			usable -= o->ptr ? a->usable_size(o->ptr) : 0;
+			t0 = now_ns();
+			a->free(o->ptr);
+			record(&hist[3], now_ns() - t0);
+			o->ptr = NULL;
+			o->size = 0;
+			ptr = NULL;
+			break;
+		}
+
+		if (ptr != NULL && o != &objs[0]) {
+			touch(ptr, arg[1]);
+			o->ptr = ptr;
+			o->size = arg[1];
+			requested += o->size;
+			usable += a->usable_size(ptr);
+		}
+		peak_requested = requested > peak_requested ? requested : peak_requested;
+		peak_usable = usable > peak_usable ? usable : peak_usable;
+
+		if (++events % interval == 0) {
+			rss = rss_kb() - base_rss;
+			peak_rss = rss > peak_rss ? rss : peak_rss;
+			printf("%12llu %14zu %14zu %7.2f%% %10ld %10.2f", (unsigned long long) events,
+				requested / 1024, usable / 1024, usable ? 100.0 * (usable - requested) / usable : 0.0,
+				rss, requested ? rss * 1024.0 / requested : 0.0);
+			if (a == &buddy) {
+				buddy_stats(&st);
+				printf(" %12zu %7.2f%%", st.free_bytes / 1024,
+					st.free_bytes ? 100.0 * (st.free_bytes - st.largest_free) / st.free_bytes : 0.0);
+			}
+			printf("\n");
+		}
+	}
+
+	for (i = 0; i < 4; i++) {
+		print_histogram(&hist[i]);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("\n%llu events, peak requested %zu KB, peak usable %zu KB, peak RSS %ld KB (sampled), %ld KB (ru_maxrss)\n",
+		(unsigned long long) events, peak_requested / 1024, peak_usable / 1024, peak_rss, ru.ru_maxrss);
+	if (a == &buddy) {
+		buddy_stats(&st);
+		printf("buddy_stats: %llu mallocs, %llu frees, %llu splits, %llu merges, %.2f%% internal fragmentation over all allocations\n",
+			st.mallocs, st.frees, st.splits, st.merges, 100.0 * st.internal_fragmentation);
+		printf("             pool %zu KB, free %zu KB, largest free block %zu KB, slabs %zu KB with %zu KB free\n",
+			st.pool_bytes / 1024, st.free_bytes / 1024, st.largest_free / 1024, st.slab_bytes / 1024,
+			st.slab_free_bytes / 1024);
+	}
+	if (a == &buddy && map != NULL) {
+		int fd = open(map, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+		if (fd < 0 || buddy_dump_map(fd) != TRUE) {
+			perror(map);
+			if (fd >= 0) {
+				close(fd);
+			}
+			goto out;
+		}
+		if (close(fd) != 0) {
+			perror(map);
+			goto out;
+		}
+	}
+	ret = 0;
+
+out:
+	fclose(f);
+	free(objs);
+	return ret;
+}
+
+
+static int usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-s] [-i interval] [-m map] trace\n       %s -c text-trace trace\n", prog, prog);
+	return 2;
+}
+
+int main(int argc, char *argv[]) {
+	const struct allocator *a = &buddy;
+	unsigned long interval = DEFAULT_INTERVAL;
+	const char *map = NULL;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-c") == 0) {
+			return argc == i + 3 ? convert(argv[i + 1], argv[i + 2]) : usage(argv[0]);
+		} else if (strcmp(argv[i], "-s") == 0) {
+			a = &sys;
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc && (interval = strtoul(argv[i + 1], NULL, 10)) > 0) {
+			i++;
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			map = argv[++i];
+		} else {
+			return usage(argv[0]);
+		}
+	}
+
+	if (i != argc - 1) {
+		return usage(argv[0]);
+	}
+	return replay(argv[i], a, interval, map);
+}
@@ -0,0 +1,476 @@
+/**
+ * Multi-threaded stress test for the locking of libbuddy. Threads share a table
+ * of slots and each op takes a random slot over with an atomic exchange: a
+ * slot that held an object has its contents checked and is then freed,
+ * reallocated, freed with its size or freed in a batch along with objects
+ * taken out of other slots, most likely by another thread than the one that
+ * allocated it; an empty slot gets a new object from malloc, calloc, memalign
+ * or a batch allocation, whose other objects go to empty slots. Every object
+ * starts with its size and is filled with a byte derived from its address, so
+ * an object handed out twice, or a free that scribbles on memory in use, shows
+ * up as a mismatch.
+ *
+ * Once the threads are done every object is freed, and the pool must have
+ * coalesced back: with BUDDY_NOSLAB a single allocation of the whole pool has
+ * to succeed, which it only does if the free lists hold one block again; with
+ * slabs, which keep one empty spare per size class, everything but those
+ * spares must be on the free lists. The call counters must balance as well.
+ *
+ * Each combination of BUDDY_NOHEADER, BUDDY_NOSLAB, BUDDY_LAZY and
+ * BUDDY_GROWABLE on top of BUDDY_THREADSAFE runs once on the default arena,
+ * whose thread caches it exercises, and once on an arena of its own, each in
+ * a child process. Every other combination runs with the heap profiler
+ * sampling, whose profile must hold no live object at the end, and every
+ * other pair of them with the pool's background worker merging freed blocks.
+ * Built with -DBUDDY_HARDENED, as "make stress" also does, every run holds
+ * QUARANTINE bytes of freed memory back.
+ *
+ * Usage: buddy-stress [threads [ops per thread]]
+ *
+ * @author Wyatt Cupp
+ *
+ */
+
+#include "buddy.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 100000
+#define SLOTS 4096
+#define POOL_SIZE ((size_t) 1 << 28)
+#define MAX_KVAL 15 /* objects of up to 32 KB */
+#define SPARE_SLAB (16*1024) /* size of a slab, of which each class keeps one */
+#define SLAB_CLASSES 15
+#define ALIGNED_OBJ (UINT64_C(1) << 63) /* in an object's size word: from memalign */
+#define BATCH 8 /* objects allocated or freed at once at most */
+#define PROFILE_RATE (64*1024)
+#define QUARANTINE (1024*1024)
+
+static const int combos[] = {
+	0, BUDDY_NOHEADER, BUDDY_NOSLAB, BUDDY_LAZY, BUDDY_GROWABLE,
+	BUDDY_NOHEADER|BUDDY_NOSLAB, BUDDY_NOHEADER|BUDDY_LAZY, BUDDY_NOHEADER|BUDDY_GROWABLE,
+	BUDDY_NOSLAB|BUDDY_LAZY, BUDDY_NOSLAB|BUDDY_GROWABLE, BUDDY_LAZY|BUDDY_GROWABLE,
+	BUDDY_NOHEADER|BUDDY_NOSLAB|BUDDY_LAZY, BUDDY_NOHEADER|BUDDY_NOSLAB|BUDDY_GROWABLE,
+	BUDDY_NOHEADER|BUDDY_LAZY|BUDDY_GROWABLE, BUDDY_NOSLAB|BUDDY_LAZY|BUDDY_GROWABLE,
+	BUDDY_NOHEADER|BUDDY_NOSLAB|BUDDY_LAZY|BUDDY_GROWABLE,
+};
+#define NCOMBOS (sizeof(combos) / sizeof(combos[0]))
+
+static void *slot[SLOTS];
+static buddy_arena_t *arena; /* NULL for the default arena */
+static size_t ops_per_thread;
+static int failed;
+
+/* xorshift64*, as in buddy-bench */
+static uint64_t next_rand(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * UINT64_C(2685821657736338717);
+}
+
+/* size in [8, 2^MAX_KVAL), uniform over its log2 */
+static size_t log_size(uint64_t *state) {
+	unsigned int k = 3 + next_rand(state) % (MAX_KVAL - 3);
+	size_t lo = (size_t) 1 << k;
+	return lo + next_rand(state) % lo;
+}
+
+static void *stress_malloc(size_t size) {
+	return arena ? buddy_arena_malloc(arena, size) : buddy_malloc(size);
+}
+
+static void *stress_calloc(size_t size) {
+	return arena ? buddy_arena_calloc(arena, 1, size) : buddy_calloc(1, size);
+}
+
+static void *stress_realloc(void *ptr, size_t size) {
+	return arena ? buddy_arena_realloc(arena, ptr, size) : buddy_realloc(ptr, size);
+}
+
+static void *stress_memalign(size_t align, size_t size) {
+	return arena ? buddy_arena_memalign(arena, align, size) : buddy_memalign(align, size);
+}
+
+static void stress_free(void *ptr) {
+	if (arena) {
+		buddy_arena_free(arena, ptr);
+	} else {
+		buddy_free(ptr);
+	}
+}
+
+static void stress_free_sized(void *ptr, size_t size) {
+	if (arena) {
+		buddy_arena_free_sized(arena, ptr, size);
+	} else {
+		buddy_free_sized(ptr, size);
+	}
+}
+
+static size_t stress_malloc_batch(size_t size, size_t n, void **out) {
+	return arena ? buddy_arena_malloc_batch(arena, size, n, out) : buddy_malloc_batch(size, n, out);
+}
+
+static void stress_free_batch(void **ptrs, size_t n) {
+	if (arena) {
+		buddy_arena_free_batch(arena, ptrs, n);
+	} else {
+		buddy_free_batch(ptrs, n);
+	}
+}
+
+static unsigned char fill_byte(void *ptr, size_t size) {
+	return (unsigned char) (((uintptr_t) ptr >> 3) ^ size);
+}
+
+/* stamps a new object of size bytes (at least 8) at ptr */
+static void fill(void *ptr, uint64_t word) {
+	size_t size = word & ~ALIGNED_OBJ;
+
+	*(uint64_t *) ptr = word;
+	memset((char *) ptr + sizeof(uint64_t), fill_byte(ptr, size), size - sizeof(uint64_t));
+}
+
+/* the size word of the object at ptr if its contents are intact, 0 otherwise */
+static uint64_t check(void *ptr) {
+	uint64_t word = *(uint64_t *) ptr;
+	size_t size = word & ~ALIGNED_OBJ, i;
+	unsigned char c = fill_byte(ptr, size);
+
+	if (size < sizeof(uint64_t) || size >= ((size_t) 1 << MAX_KVAL)) {
+		return 0;
+	}
+	for (i = sizeof(uint64_t); i < size; i++) {
+		if (((unsigned char *) ptr)[i] != c) {
+			return 0;
+		}
+	}
+	return word;
+}
+
+static void fail(const char *what, void *ptr) {
+	fprintf(stderr, "%s at %p\n", what, ptr);
+	__atomic_store_n(&failed, TRUE, __ATOMIC_RELAXED);
+}
+
+/**
+ * A new object for an empty slot out of a batch of objects of size bytes; the
+ * others go to empty slots, and those that find none are freed in a batch.
+ */
+static void *create_batch(size_t size, uint64_t *rng) {
+	void *batch[BATCH], *first, *expected;
+	size_t n = stress_malloc_batch(size, 2 + next_rand(rng) % (BATCH - 1), batch), i, left = 0;
+
+	for (i = 0; i < n; i++) {
+		fill(batch[i], size);
+	}
+	first = n > 0 ? batch[0] : NULL;
+	for (i = 1; i < n; i++) {
+		expected = NULL;
+		if (!__atomic_compare_exchange_n(&slot[next_rand(rng) % SLOTS], &expected, batch[i], FALSE,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			batch[left++] = batch[i];
+		}
+	}
+	for (i = 0; i < left; i++) {
+		if (check(batch[i]) == 0) {
+			fail("object overwritten", batch[i]);
+		}
+	}
+	stress_free_batch(batch, left);
+	return first;
+}
+
+/* a new object for an empty slot: malloc, calloc, memalign or a batch */
+static void *create(uint64_t *rng) {
+	size_t size = log_size(rng), i;
+	unsigned int how = next_rand(rng) % 8;
+	void *ptr;
+
+	if (how == 2) {
+		return create_batch(size, rng);
+	}
+
+	if (how == 0) {
+		size_t align = (size_t) 16 << next_rand(rng) % 9;
+
+		ptr = stress_memalign(align, size);
+		if (ptr != NULL && ((uintptr_t) ptr & (align - 1)) != 0) {
+			fail("misaligned memalign", ptr);
+		}
+		if (ptr != NULL) {
+			fill(ptr, size | ALIGNED_OBJ);
+		}
+		return ptr;
+	}
+	if (how == 1) {
+		ptr = stress_calloc(size);
+		for (i = 0; ptr != NULL && i < size; i++) {
+			if (((char *) ptr)[i] != 0) {
+				fail("calloc memory not zero", ptr);
+				break;
+			}
+		}
+	} else {
+		ptr = stress_malloc(size);
+	}
+	if (ptr != NULL) {
+		fill(ptr, size);
+	}
+	return ptr;
+}
+
+/* frees ptr, checked already, in a batch with the objects of a few other slots */
+static void retire_batch(void *ptr, uint64_t *rng) {
+	void *batch[BATCH];
+	size_t n = 1, i;
+
+	batch[0] = ptr;
+	for (i = 1 + next_rand(rng) % (BATCH - 1); i > 0; i--) {
+		void *other = __atomic_exchange_n(&slot[next_rand(rng) % SLOTS], NULL, __ATOMIC_ACQ_REL);
+
+		if (other != NULL && check(other) == 0) {
+			fail("object overwritten", other);
+		} else if (other != NULL) {
+			batch[n++] = other;
+		}
+	}
+	stress_free_batch(batch, n);
+}
+
+/* checks the object taken out of a slot and frees it, or resizes it and returns it */
+static void *retire(void *ptr, uint64_t *rng) {
+	uint64_t word = check(ptr);
+	size_t size = word & ~ALIGNED_OBJ, keep;
+	unsigned int how = next_rand(rng) % 4;
+	void *moved;
+
+	if (word == 0) {
+		fail("object overwritten", ptr);
+		return NULL;
+	}
+
+	if (how == 0) {
+		size_t to = log_size(rng);
+
+		moved = stress_realloc(ptr, to);
+		if (moved == NULL) {
+			return ptr;
+		}
+		// the part both sizes cover must have moved along
+		keep = size < to ? size : to;
+		if (*(uint64_t *) moved != word || (keep > 8 && ((unsigned char *) moved)[keep - 1] != fill_byte(ptr, size))) {
+			fail("realloc lost contents", moved);
+		}
+		fill(moved, to | (word & ALIGNED_OBJ));
+		return moved;
+	}
+
+	// memory from memalign must go to buddy_free
+	if (how == 1 && !(word & ALIGNED_OBJ)) {
+		stress_free_sized(ptr, size);
+	} else if (how == 2) {
+		retire_batch(ptr, rng);
+	} else {
+		stress_free(ptr);
+	}
+	return NULL;
+}
+
+static void *worker(void *arg) {
+	uint64_t rng = (uintptr_t) arg * UINT64_C(0x9e3779b97f4a7c15) + 1;
+	size_t op;
+
+	for (op = 0; op < ops_per_thread && !__atomic_load_n(&failed, __ATOMIC_RELAXED); op++) {
+		unsigned int i = next_rand(&rng) % SLOTS;
+		void *ptr = __atomic_exchange_n(&slot[i], NULL, __ATOMIC_ACQ_REL);
+		void *expected = NULL;
+
+		ptr = ptr != NULL ? retire(ptr, &rng) : create(&rng);
+
+		// another thread may have filled the slot meanwhile
+		if (ptr != NULL && !__atomic_compare_exchange_n(&slot[i], &expected, ptr, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			if (check(ptr) == 0) {
+				fail("object overwritten", ptr);
+			}
+			stress_free(ptr);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Frees what is left in the slots, and what the quarantine holds back; run on
+ * a thread of its own, whose cache goes back when it exits.
+ */
+static void *drain(void *arg) {
+	unsigned int i;
+
+	for (i = 0; i < SLOTS; i++) {
+		if (slot[i] != NULL) {
+			if (check(slot[i]) == 0) {
+				fail("object overwritten", slot[i]);
+			}
+			stress_free(slot[i]);
+			slot[i] = NULL;
+		}
+	}
+	buddy_quarantine(0);
+	return arg;
+}
+
+/* TRUE if the pool holds nothing any more and has merged back, see above */
+static int coalesced(int flags) {
+	struct buddy_stats stats;
+	void *all;
+
+	if (arena) {
+		buddy_arena_stats(arena, &stats);
+	} else {
+		buddy_stats(&stats);
+	}
+	if (stats.mallocs != stats.frees) {
+		fprintf(stderr, "%llu mallocs but %llu frees\n", stats.mallocs, stats.frees);
+		return FALSE;
+	}
+	if (stats.free_bytes + stats.slab_bytes != stats.pool_bytes) {
+		fprintf(stderr, "%zu bytes of %zu neither free nor in slabs\n",
+			stats.pool_bytes - stats.free_bytes - stats.slab_bytes, stats.pool_bytes);
+		return FALSE;
+	}
+	if (!(flags & BUDDY_NOSLAB)) {
+		if (stats.slab_bytes > SLAB_CLASSES * SPARE_SLAB) {
+			fprintf(stderr, "%zu bytes left in slabs\n", stats.slab_bytes);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	// the whole pool in one piece, which also merges what BUDDY_LAZY deferred
+	all = stress_malloc(stats.pool_bytes - 64);
+	if (all == NULL) {
+		fprintf(stderr, "the pool did not coalesce: largest free block %zu of %zu bytes\n",
+			stats.largest_free, stats.pool_bytes);
+		return FALSE;
+	}
+	stress_free(all);
+	return TRUE;
+}
+
+/* TRUE if the heap profile holds no live object any more */
+static int profile_empty(void) {
+	unsigned long long objs = 0, bytes = 0;
+	FILE *f = tmpfile();
+	int ok;
+
+	if (f == NULL || buddy_profile_dump(fileno(f)) != TRUE) {
+		perror("buddy_profile_dump");
+		return FALSE;
+	}
+	rewind(f);
+	ok = fscanf(f, "heap profile: %llu: %llu", &objs, &bytes) == 2 && objs == 0 && bytes == 0;
+	if (!ok) {
+		fprintf(stderr, "%llu objects of %llu bytes still sampled\n", objs, bytes);
+	}
+	fclose(f);
+	return ok;
+}
+
+static int stress(int flags, int use_arena, int profile, int background, unsigned int nthreads) {
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	pthread_t drainer;
+	unsigned int t;
+
+	if (use_arena) {
+		arena = buddy_arena_create_flags(POOL_SIZE, flags);
+		if (arena == NULL) {
+			perror("buddy_arena_create_flags");
+			return 1;
+		}
+	} else if (buddy_init_flags(POOL_SIZE, flags) != TRUE) {
+		perror("buddy_init_flags");
+		return 1;
+	}
+	if (background && (arena ? buddy_arena_background_start(arena, 64, 1) : buddy_background_start(64, 1)) != TRUE) {
+		perror("buddy_background_start");
+		return 1;
+	}
+	if (profile) {
+		buddy_profile_start(PROFILE_RATE);
+	}
+	// only a -DBUDDY_HARDENED build has a quarantine
+	buddy_quarantine(QUARANTINE);
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_create(&threads[t], NULL, worker, (void *) (uintptr_t) (t + 1));
+	}
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	pthread_create(&drainer, NULL, drain, NULL);
+	pthread_join(drainer, NULL);
+
+	// what the worker left is merged
+	if (arena) {
+		buddy_arena_background_stop(arena);
+	} else {
+		buddy_background_stop();
+	}
+	if (profile) {
+		buddy_profile_stop();
+		if (!profile_empty()) {
+			return 1;
+		}
+	}
+
+	return failed || !coalesced(flags);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int nthreads = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_THREADS;
+	unsigned int c;
+	int use_arena, status, result = 0;
+
+	ops_per_thread = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_OPS;
+	if (nthreads == 0 || ops_per_thread == 0) {
+		fprintf(stderr, "usage: %s [threads [ops per thread]]\n", argv[0]);
+		return 2;
+	}
+
+	for (c = 0; c < NCOMBOS; c++) {
+		for (use_arena = 0; use_arena <= 1; use_arena++) {
+			int flags = BUDDY_THREADSAFE | combos[c];
+			struct timespec t0, t1;
+			char name[64];
+			pid_t pid;
+
+			int profile = c % 2, background = c % 4 >= 2;
+
+			snprintf(name, sizeof(name), "threadsafe%s%s%s%s", flags & BUDDY_NOHEADER ? "|noheader" : "",
+				flags & BUDDY_NOSLAB ? "|noslab" : "", flags & BUDDY_LAZY ? "|lazy" : "",
+				flags & BUDDY_GROWABLE ? "|growable" : "");
+			printf("%-42s %-7s %-8s %-6s ", name, use_arena ? "arena" : "default",
+				profile ? "profile" : "", background ? "worker" : "");
+			fflush(stdout);
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			pid = fork();
+			if (pid == 0) {
+				exit(stress(flags, use_arena, profile, background, nthreads));
+			}
+			if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				printf("FAILED\n");
+				result = 1;
+				continue;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			printf("ok %.2fs\n", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9);
+		}
+	}
+
+	return result;
+}
@@ -7,294 +7,4051 @@
  * and previous pointers. Each reserved block has the tag and kval 
  * field only. All allocations are done in powers of two. All requests
  * are rounded up to the next power of two.
+ *
+ * Small requests (up to 2 KB) are served by a slab layer instead: blocks of
+ * 16 KB are carved into slots of one size class each, tracked by a bitmap in
+ * the slab's first bytes, and go back to the lists only once all their slots
+ * are free.
  * 
  * @author Wyatt Cupp
  * 
  */
  
 #include "buddy.h"
+#include "kval.h"
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef BUDDY_INSTRUMENT
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#endif
 
 static int initialized = FALSE; // used for buddy_init flag
 
+/* the header for an available block */
+struct block_header {
+	union {
+		struct {
+			short tag;
+			short kval;
+		};
+		uint32_t state; // tag and kval as one word, read and written atomically
+	};
+	unsigned int flags; // BLOCK_* bits of a block on a list or in a thread cache
+	struct block_header *next;
+	struct block_header *prev;
+};
+
+const int RESERVED = 0;
+const int FREE = 1;
+const int UNUSED = -1; /* useful for header nodes */
+const int ALIGNED = 2; /* header in front of an aligned pointer inside its block */
+
+/* every byte of the block past its header is known to be zero */
+#define BLOCK_ZERO 0x1
+/* BUDDY_LAZY: the block went on its list without merging with its buddy */
+#define BLOCK_LAZY 0x2
+
+
+/* supports memory upto 2^(MAX_KVAL-1) (or 64 GB) in size */
+#define  MAX_KVAL  37
+#define MAX_SIZE ((size_t) 1 << (MAX_KVAL-1))
+
+
+/* the smallest block holds a free block's header: 32 bytes */
+#define MIN_KVAL KVAL_CONST(sizeof(struct block_header))
+
+
+/*
+ * BUDDY_NOHEADER pools keep tag and kval of every block in a side table with
+ * one byte per 2^MIN_KVAL bytes of pool, indexed by the block's offset from
+ * the pool start. Only the byte of a block's first unit is meaningful.
+ */
+#define META_FREE 0x80
+#define META_KVAL 0x3f
+
+
+/* default memory allocation is 512MB */
+const size_t DEFAULT_MAX_MEM_SIZE = 512*1024*1024;
+
+
+/* huge page sizes for BUDDY_HUGETLB and BUDDY_HUGETLB_1GB */
+#define HUGE_2MB_KVAL 21
+#define HUGE_1GB_KVAL 30
+
+
+/* free blocks of at least 2 MB (and two pages) hand their memory back to the OS */
+#define PURGE_MIN_KVAL 21
+
+
+/*
+ * A BUDDY_LAZY pool puts up to LAZY_LIMIT freed blocks of an order, and no more
+ * than LAZY_BYTES of them, on its list unmerged; the next one coalesces the
+ * whole list.
+ */
+#define LAZY_LIMIT 64
+#define LAZY_BYTES (UINT64_C(1) << 20)
+
+
+/* a growable pool reserves room for up to 64 chunks, and at most 1 TB of address space */
+#define GROW_MAX_CHUNKS 64
+#define GROW_MAX_RESERVE_KVAL 40
+
+/*
+ * Slabs: a reserved block of order SLAB_KVAL holding slots of one size class.
+ * Classes step by powers of two with one class halfway between, from 8 bytes
+ * up to SLAB_MAX_SIZE.
+ */
+#define SLAB_KVAL 14
+#define SLAB_CLASSES 15
+#define SLAB_MAX_SIZE 2048
+#define SLAB_MAP_WORDS ((1 << SLAB_KVAL) / 8 / 64) /* a bit for each possible 8-byte slot */
+
+static const unsigned short int slab_sizes[SLAB_CLASSES] = {
+	8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+/* a slab's header, at the start of its block */
+struct slab {
+	struct block_header block; // the block's own header; next and prev link the class's partial list
+	unsigned short int cls;    // size class index
+	unsigned short int nslots; // slots in the slab
+	unsigned short int nfree;  // slots not handed out
+	unsigned short int hint;   // no free slot below word hint of freemap
+	unsigned int offset;       // offset of the first slot from the slab's start
+#ifdef BUDDY_HARDENED
+	unsigned int recip;        // 2^32 / slot size + 1, see slot_index
+#endif
+	uint64_t freemap[SLAB_MAP_WORDS]; // bit i is set while slot i is free
+};
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+
+/*
+ * Call counters for buddy_stats. Each has a single writer, the thread owning
+ * it or the holder of the lock guarding it, and stores with __atomic_store_n so
+ * that buddy_stats may read them at any time. A BUDDY_THREADSAFE arena without
+ * thread caches keeps COUNTER_STRIPES sets, each on a cache line of its own: a
+ * thread adds to the set its counter_stripe picks, atomically, as threads only
+ * share a set once there are more of them than sets.
+ */
+struct counters {
+	uint64_t mallocs;
+	uint64_t frees;
+	uint64_t requested; // bytes asked for by every allocation counted in mallocs
+	uint64_t reserved;  // bytes of the blocks and slots handed out for them
+	uint64_t splits;    // blocks split in two
+	uint64_t merges;    // pairs of buddies combined
+};
+
+#define COUNTER_STRIPES 16
+
+/* numbers the threads as they first count something, from 1; see pool_counters */
+static __thread unsigned int counter_stripe __attribute__((tls_model("initial-exec")));
+static unsigned int counter_stripes;
+
+typedef char buddy_orders_check[BUDDY_ORDERS == MAX_KVAL ? 1 : -1];
+
+
+/* A structure per arena stores the table of pointers to the lists in the buddy system.  */
+struct buddy_arena {
+	void *start; // pointer to the start of the memory pool
+	int lgsize;  // log2 of size
+	size_t size; // size of the pool, same as 2 ^ lgsize
+	int flags;   // BUDDY_* flags passed to buddy_init_flags
+	unsigned short int pagekval;  // log2 of the page size backing the pool
+	unsigned short int purgekval; // free blocks of this order or more give their pages back
+	uint64_t availmap; // bit j is set while avail[j] is non-empty
+	/* a BUDDY_GROWABLE pool is a row of chunks of 2^lgsize bytes, each the root of its own buddy system */
+	unsigned int maxchunks; // chunks the reserved address space holds, starting at start
+	uint64_t chunkmap;      // bit i is set while chunk i is mapped; chunk 0 always is
+	unsigned char *meta;    // BUDDY_NOHEADER: tag and kval per 2^MIN_KVAL unit of every chunk
+	uint64_t *slabmap;      // bit i is set while the 2^SLAB_KVAL bytes at start + i * 2^SLAB_KVAL are a slab; NULL without slabs
+	uint64_t *sampledmap;   // bit i is set while the block at start + i * 2^MIN_KVAL is sampled by the profiler
+	pthread_mutex_t chunk_lock; // serializes mapping and unmapping chunks
+	/* BUDDY_THREADSAFE pools may merge freed blocks on a worker thread, see buddy_arena_background_start */
+	struct block_header *freed; // blocks freed while the worker runs, linked through next; pushed without a lock
+	int background;             // TRUE while the worker runs
+	size_t worker_budget;       // blocks the worker merges per interval, 0 for no limit
+	unsigned int worker_interval; // ms between the worker's passes
+	pthread_t worker;
+	pthread_mutex_t worker_lock; // held by whoever takes blocks off freed; the worker sleeps on it
+	pthread_cond_t worker_wake;
+	struct buddy_arena *next_arena; // the next arena created by buddy_arena_create_flags
+	/* calls on the pool, but for those counted by thread caches; a single set unless striped */
+	struct counter_stripe {
+		struct counters c;
+	} __attribute__((aligned(64))) counters[COUNTER_STRIPES];
+	/* the table of pointers to the buddy system lists */
+	struct block_header avail[MAX_KVAL];
+	/* in BUDDY_THREADSAFE mode avail[k] is guarded by locks[k] alone */
+	struct avail_lock {
+		pthread_mutex_t mutex;
+		unsigned int lazy; // BUDDY_LAZY: BLOCK_LAZY blocks on avail[k], see lazy_room
+		size_t nfree;      // blocks on avail[k]
+	} __attribute__((aligned(64))) locks[MAX_KVAL];
+	/* slabs of each size class with a free slot; full slabs are on no list */
+	struct slab_class {
+		pthread_mutex_t mutex;
+		struct block_header partial;
+		size_t nslabs;     // slabs of the class
+		size_t free_slots; // slots of those not handed out
+	} __attribute__((aligned(64))) slabs[SLAB_CLASSES];
+};
+
+
+/* initialize structures */
+
+/* the default arena behind buddy_malloc, buddy_free, etc. */
+static struct buddy_arena mempool;
+
+/* the other arenas, which the fork handlers lock along with the default one */
+static struct buddy_arena *arenas;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Per-thread caches (BUDDY_THREADSAFE only). Each thread keeps a stack of
+ * reserved blocks per small order, so most buddy_malloc/buddy_free calls never
+ * touch the shared lists. A cache is refilled from avail[] TCACHE_BATCH blocks
+ * at a time and flushed back in the same batches once it holds TCACHE_LIMIT.
+ * Re-initializing the default pool unmaps the blocks the caches hold: each
+ * cache remembers the generation of the pool it was filled from and forgets
+ * its contents, and its counters, once buddy_init_flags starts another.
+ */
+#define TCACHE_MAX_KVAL 12 /* blocks up to 4 KB, header included */
+#define TCACHE_BATCH 16
+#define TCACHE_LIMIT (2*TCACHE_BATCH)
+
+struct tcache {
+	struct block_header *head[TCACHE_MAX_KVAL+1]; // linked through next
+	unsigned int count[TCACHE_MAX_KVAL+1];
+	void **slot[SLAB_CLASSES]; // slab slots, linked through their first word
+	unsigned int nslot[SLAB_CLASSES];
+	int registered; // set once the exit destructor knows about this cache
+	unsigned int generation; // pool_generation when the cache was last emptied
+	struct counters counters; // calls on the default arena by this thread
+	struct tcache *next_tcache; // the next registered cache, for buddy_stats
+};
+
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* the registered caches, and the counters of those whose threads exited */
+static struct tcache *tcaches;
+static struct counters tcache_exited;
+static pthread_mutex_t tcaches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* bumped by every buddy_init_flags; caches of an older generation hold blocks of an unmapped pool */
+static unsigned int pool_generation;
+
+/* guards the heap profiler's tables, see profile_record */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef BUDDY_HARDENED
+/* guards the quarantine, see quarantine_hold; taken before any pool lock */
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Built with -DBUDDY_INSTRUMENT, buddy_malloc and buddy_free record their cost
+ * in cycles and the splits or merges they did into process-wide histograms, by
+ * atomic adds without locks, and fire USDT probes where <sys/sdt.h> exists:
+ * buddy:malloc(ptr, size, cycles, splits), buddy:free(ptr, cycles, merges),
+ * buddy:split(pool, n) and buddy:merge(pool, n). Without it none of this is
+ * compiled and the macros below expand to nothing.
+ */
+#ifdef BUDDY_INSTRUMENT
+
+#define HIST_SUB_BITS 4 /* 16 buckets per power of two */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+typedef char buddy_hist_check[BUDDY_HIST_BUCKETS == (64 - HIST_SUB_BITS + 1) * HIST_SUB ? 1 : -1];
+
+static struct buddy_histograms histograms;
+
+/* splits and merges done by this thread so far, for the steps of one call */
+static __thread struct {
+	uint64_t splits;
+	uint64_t merges;
+} steps __attribute__((tls_model("initial-exec")));
+
+struct call_probe {
+	uint64_t start;  // cycles() when the call began
+	uint64_t splits; // steps.splits then
+	uint64_t merges; // steps.merges then
+};
+
+#ifndef DTRACE_PROBE2
+#define DTRACE_PROBE2(provider, name, a1, a2)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#endif
+
+#define CALL_BEGIN(p) struct call_probe p; call_begin(&p)
+#define MALLOC_END(p, ptr, size) malloc_end(&p, ptr, size)
+#define FREE_END(p, ptr) free_end(&p, ptr)
+
+/* the time stamp counter where there is one, else nanoseconds */
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t t;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (t));
+	return t;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* values below HIST_SUB have a bucket each, larger ones share it with those within 1/HIST_SUB */
+static unsigned int hist_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB) {
+		return v;
+	}
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (unsigned int) (v >> (e - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* the largest value that falls in bucket b */
+static uint64_t hist_value(unsigned int b)
+{
+	unsigned int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+	if (b < HIST_SUB) {
+		return b;
+	}
+	return ((uint64_t) (HIST_SUB + (b & (HIST_SUB - 1))) << (e - HIST_SUB_BITS))
+		+ (UINT64_C(1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(struct buddy_histogram *h, uint64_t v)
+{
+	unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&h->buckets[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		;
+	}
+}
+
+/* a snapshot of h, with the count that hist_record leaves to the buckets */
+static void hist_copy(struct buddy_histogram *to, struct buddy_histogram *h)
+{
+	unsigned int b;
+
+	to->count = 0;
+	to->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	for (b = 0; b < BUDDY_HIST_BUCKETS; b++) {
+		to->buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+		to->count += to->buckets[b];
+	}
+}
+
+static void call_begin(struct call_probe *p)
+{
+	p->splits = steps.splits;
+	p->merges = steps.merges;
+	p->start = cycles();
+}
+
+static void malloc_end(struct call_probe *p, void *ptr, size_t size)
+{
+	uint64_t t = cycles() - p->start;
+	uint64_t n = steps.splits - p->splits;
+
+	hist_record(&histograms.malloc_cycles, t);
+	hist_record(&histograms.malloc_splits, n);
+	DTRACE_PROBE4(buddy, malloc, ptr, size, t, n);
+}
+
+static void free_end(struct call_probe *p, void *ptr)
+{
+	uint64_t t = cycles() - p->start;
+	uint64_t n = steps.merges - p->merges;
+
+	hist_record(&histograms.free_cycles, t);
+	hist_record(&histograms.free_merges, n);
+	DTRACE_PROBE3(buddy, free, ptr, t, n);
+}
+
+#else
+
+#define CALL_BEGIN(p)
+#define MALLOC_END(p, ptr, size)
+#define FREE_END(p, ptr)
+
+#endif /* BUDDY_INSTRUMENT */
+
+
+static struct counters *pool_counters(struct buddy_arena *pool);
+static void counter_add(struct buddy_arena *pool, uint64_t *c, uint64_t n);
+
+/* counts n blocks split in two, for buddy_stats and the call's histograms */
+static void count_splits(struct buddy_arena *pool, uint64_t n)
+{
+	counter_add(pool, &pool_counters(pool)->splits, n);
+#ifdef BUDDY_INSTRUMENT
+	steps.splits += n;
+	DTRACE_PROBE2(buddy, split, pool, n);
+#endif
+}
+
+
+/* counts n pairs of buddies combined, likewise */
+static void count_merges(struct buddy_arena *pool, uint64_t n)
+{
+	counter_add(pool, &pool_counters(pool)->merges, n);
+#ifdef BUDDY_INSTRUMENT
+	steps.merges += n;
+	DTRACE_PROBE2(buddy, merge, pool, n);
+#endif
+}
+
+
+/*
+ * Locking in BUDDY_THREADSAFE mode: a thread holds at most one order lock at a
+ * time, so splits and merges only contend on the orders they touch. A block
+ * header reads FREE with kval k exactly while the block is on AVAIL[k], and both
+ * entering and leaving that state happen under locks[k]; whoever takes a block
+ * off a list marks it RESERVED before dropping the lock. So under locks[k] the
+ * state word of a buddy alone tells whether it may be combined, even while other
+ * threads rewrite headers of blocks they own at other orders.
+ */
+static void pool_mutex_lock(struct buddy_arena *pool, pthread_mutex_t *mutex) {
+	if (pool->flags & BUDDY_THREADSAFE) {
+		pthread_mutex_lock(mutex);
+	}
+}
+
+
+static void pool_mutex_unlock(struct buddy_arena *pool, pthread_mutex_t *mutex) {
+	if (pool->flags & BUDDY_THREADSAFE) {
+		pthread_mutex_unlock(mutex);
+	}
+}
+
+
+static void order_lock(struct buddy_arena *pool, int k) {
+	pool_mutex_lock(pool, &pool->locks[k].mutex);
+}
+
+
+static void order_unlock(struct buddy_arena *pool, int k) {
+	pool_mutex_unlock(pool, &pool->locks[k].mutex);
+}
+
+
+/**
+ * Side table byte of block L in a BUDDY_NOHEADER pool.
+ */
+static unsigned char *meta_of(struct buddy_arena *pool, struct block_header *L) {
+	return pool->meta + (((char *) L - (char *) pool->start) >> MIN_KVAL);
+}
+
+
+/**
+ * The state word of tag and kval, built arithmetically: filling in the two
+ * halves of a union and reading the word back makes the compiler go through
+ * the stack, where the word load stalls on the two narrower stores.
+ */
+static uint32_t make_state(short tag, short kval) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (uint32_t) (unsigned short) tag << 16 | (unsigned short) kval;
+#else
+	return (uint32_t) (unsigned short) kval << 16 | (unsigned short) tag;
+#endif
+}
+
+
+/**
+ * Publishes tag and kval of block L with a single store, to its header or,
+ * in a BUDDY_NOHEADER pool, to its side table byte.
+ */
+static void set_state(struct buddy_arena *pool, struct block_header *L, short tag, short kval) {
+	if (pool->flags & BUDDY_NOHEADER) {
+		__atomic_store_n(meta_of(pool, L), (tag == FREE ? META_FREE : 0) | kval, __ATOMIC_RELEASE);
+		return;
+	}
+
+	__atomic_store_n(&L->state, make_state(tag, kval), __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Reads tag and kval of block L with a single load, as a header state word.
+ */
+static uint32_t get_state(struct buddy_arena *pool, struct block_header *L) {
+	if (pool->flags & BUDDY_NOHEADER) {
+		unsigned char m = __atomic_load_n(meta_of(pool, L), __ATOMIC_ACQUIRE);
+
+		return make_state((m & META_FREE) ? FREE : RESERVED, m & META_KVAL);
+	}
+
+	return __atomic_load_n(&L->state, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * TRUE if block L is free with order k, i.e. currently on AVAIL[k].
+ */
+static int is_free_at(struct buddy_arena *pool, struct block_header *L, int k) {
+	struct block_header h;
+
+	h.state = get_state(pool, L);
+	return h.tag == FREE && h.kval == k;
+}
+
+
+/**
+ * Order of a block the caller owns.
+ */
+static unsigned short int block_kval(struct buddy_arena *pool, struct block_header *L) {
+	struct block_header h;
+
+	h.state = get_state(pool, L);
+	return h.kval;
+}
+
+
+/**
+ * Bytes in front of the caller's memory in each block: the header, unless the
+ * pool keeps it out of band.
+ */
+static size_t header_size(struct buddy_arena *pool) {
+	return (pool->flags & BUDDY_NOHEADER) ? 0 : sizeof(struct block_header);
+}
+
+
+/**
+ * Marks order k as non-empty or empty in availmap. Other threads read the map
+ * without locks and each order's lock guards only its own bit, so a
+ * BUDDY_THREADSAFE pool needs an atomic or/and; any other pool makes do with
+ * a plain one, which costs no locked instruction.
+ */
+static void availmap_set(struct buddy_arena *pool, int k) {
+	if (pool->flags & BUDDY_THREADSAFE) {
+		__atomic_fetch_or(&pool->availmap, UINT64_C(1) << k, __ATOMIC_RELAXED);
+	} else {
+		pool->availmap |= UINT64_C(1) << k;
+	}
+}
+
+
+static void availmap_clear(struct buddy_arena *pool, int k) {
+	if (pool->flags & BUDDY_THREADSAFE) {
+		__atomic_fetch_and(&pool->availmap, ~(UINT64_C(1) << k), __ATOMIC_RELAXED);
+	} else {
+		pool->availmap &= ~(UINT64_C(1) << k);
+	}
+}
+
+
+/**
+ * Links the free block L at the front of AVAIL[k] and marks order k as non-empty.
+ * flags says what is known about its contents. Caller holds locks[k].
+ */
+static void avail_push(struct buddy_arena *pool, struct block_header *L, int k, unsigned int flags) {
+	struct block_header *head = &pool->avail[k];
+
+	L->flags = flags;
+	L->next = head->next;
+	L->prev = head;
+	head->next->prev = L;
+	head->next = L;
+	__atomic_store_n(&pool->locks[k].nfree, pool->locks[k].nfree + 1, __ATOMIC_RELAXED);
+	set_state(pool, L, FREE, k);
+	availmap_set(pool, k);
+}
+
+
+/**
+ * Unlinks block L from AVAIL[k], clearing the order's bit once the list drains,
+ * and marks L RESERVED at order k. Caller holds locks[k].
+ */
+static void avail_unlink(struct buddy_arena *pool, struct block_header *L, int k) {
+	if (L->flags & BLOCK_LAZY) {
+		L->flags &= ~BLOCK_LAZY;
+		pool->locks[k].lazy--;
+	}
+#ifdef BUDDY_HARDENED
+	if (L->next->prev != L || L->prev->next != L) {
+		fprintf(stderr, "buddy: corrupted free list at %p\n", (void *) L);
+		abort();
+	}
+#endif
+	L->prev->next = L->next;
+	L->next->prev = L->prev;
+	__atomic_store_n(&pool->locks[k].nfree, pool->locks[k].nfree - 1, __ATOMIC_RELAXED);
+	if (pool->avail[k].next == &pool->avail[k]) {
+		availmap_clear(pool, k);
+	}
+	set_state(pool, L, RESERVED, k);
+}
+
+
+/**
+ * Takes the first block off the smallest non-empty list of order >= lo, as in
+ * step 1 of Algorithm R, storing its order in *j. availmap has a bit per
+ * non-empty list, so masking off the orders below lo and counting trailing zeros
+ * yields j directly instead of probing each list head. A bit seen set may belong
+ * to a list another thread drains before we lock it; the scan then moves on and
+ * only gives up once a fresh read shows no candidate order. Returns NULL then.
+ */
+static struct block_header *avail_take(struct buddy_arena *pool, unsigned short int lo, unsigned short int *j) {
+	uint64_t usable;
+
+	while ((usable = __atomic_load_n(&pool->availmap, __ATOMIC_RELAXED) & ~((UINT64_C(1) << lo) - 1)) != 0) {
+		while (usable != 0) {
+			unsigned short int k = __builtin_ctzll(usable);
+
+			order_lock(pool, k);
+			if (pool->avail[k].next != &pool->avail[k]) {
+				struct block_header *L = pool->avail[k].next;
+				avail_unlink(pool, L, k);
+				order_unlock(pool, k);
+				*j = k;
+				return L;
+			}
+			order_unlock(pool, k);
+			usable &= usable - 1;
+		}
+	}
+	return NULL;
+}
+
+static void tcache_destroy(void *arg);
+
+static void tcache_key_create(void) {
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+
+/**
+ * Reserves address space for nchunks chunks of 2^kval bytes, aligned to 2^kval
+ * so that a block's buddy is found by flipping one bit of its address. The
+ * alignment comes from reserving one chunk more than needed, without access,
+ * and trimming both ends. Returns NULL if the address space is not available.
+ */
+static char *pool_reserve(unsigned short int kval, unsigned int nchunks) {
+	size_t size = UINT64_C(1) << kval;
+	size_t len = nchunks * size;
+
+	char *reserve = mmap(NULL, len + size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (reserve == MAP_FAILED) {
+		return NULL;
+	}
+
+	char *start = (char *) ((((uint_least64_t) reserve) + size - 1) & ~((uint_least64_t) size - 1));
+	if (start > reserve) {
+		munmap(reserve, start - reserve);
+	}
+	munmap(start + len, reserve + size - start);
+
+	return start;
+}
+
+
+/**
+ * Maps the reserved chunk of 2^kval bytes at start in place, from hugetlbfs when
+ * flags ask for it. Placement hints (transparent huge pages, a preferred NUMA
+ * node) are applied before anything touches the memory. Returns FALSE if the
+ * memory cannot be mapped.
+ *
+ * Only address space is reserved: the mapping is MAP_NORESERVE and pages are
+ * faulted in when a header or the caller first writes them, so a pool costs
+ * resident memory only for the blocks that have been split off and used.
+ */
+static int chunk_map(char *start, unsigned short int kval, int flags) {
+	size_t size = UINT64_C(1) << kval;
+	int mflags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED;
+
+	// hugetlbfs pages are reserved up front so that a fault never finds the pool empty
+	if (flags & BUDDY_HUGETLB_1GB) {
+		mflags |= MAP_HUGETLB | (HUGE_1GB_KVAL << MAP_HUGE_SHIFT);
+	} else if (flags & BUDDY_HUGETLB) {
+		mflags |= MAP_HUGETLB | (HUGE_2MB_KVAL << MAP_HUGE_SHIFT);
+	} else {
+		mflags |= MAP_NORESERVE;
+	}
+
+	if (mmap(start, size, PROT_READ|PROT_WRITE, mflags, -1, 0) == MAP_FAILED) {
+		return FALSE;
+	}
+
+	if (flags & BUDDY_HUGEPAGE) {
+		madvise(start, size, MADV_HUGEPAGE);
+	}
+
+	int node = BUDDY_NUMA_NODE_OF(flags);
+	if (node >= 0) {
+		unsigned long nodemask[256 / (8 * sizeof(unsigned long))];
+
+		memset(nodemask, 0, sizeof(nodemask));
+		nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+		// only a hint: kernels without NUMA support reject it and the pool stays usable
+		syscall(SYS_mbind, start, size, MPOL_PREFERRED, nodemask, 8 * sizeof(nodemask), 0);
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * Returns the chunk at start to the OS, leaving its address space reserved.
+ */
+static void chunk_unmap(char *start, unsigned short int kval) {
+	mmap(start, UINT64_C(1) << kval, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0);
+}
+
+
+/**
+ * Smallest pool order that chunk_map accepts with the given flags: one page.
+ */
+static unsigned short int pool_min_kval(int flags) {
+	if (flags & BUDDY_HUGETLB_1GB) {
+		return HUGE_1GB_KVAL;
+	}
+	if (flags & BUDDY_HUGETLB) {
+		return HUGE_2MB_KVAL;
+	}
+	return get_kval(sysconf(_SC_PAGESIZE));
+}
+
+
+/**
+ * Order of the pages to give back to the OS: huge pages are released whole,
+ * so that purging never splits a transparent huge page.
+ */
+static unsigned short int pool_page_kval(int flags) {
+	if (flags & (BUDDY_HUGETLB|BUDDY_HUGEPAGE)) {
+		return pool_min_kval(flags | BUDDY_HUGETLB);
+	}
+	return pool_min_kval(flags);
+}
+
+
+/**
+ * Gives the pages of [addr, addr+len) back to the OS; they read as zero when next touched.
+ */
+static void pool_purge(void *addr, size_t len) {
+	madvise(addr, len, MADV_DONTNEED);
+}
+
+
+/**
+ * Order of the pool for a requested size (0 for the default), or 0 if too large.
+ */
+static unsigned short int pool_kval(size_t size, int flags) {
+	// check if size > max available
+	if (size > MAX_SIZE) {
+		return 0;
+	}
+
+	// check for default initialization
+	if (size == 0) {
+		size = DEFAULT_MAX_MEM_SIZE;
+	}
+
+	// round to next power of 2 (unchanged if not), and to at least a page
+	unsigned short int kval = get_kval(size);
+	if (kval < pool_min_kval(flags)) {
+		kval = pool_min_kval(flags);
+	}
+	return kval;
+}
+
+
+/**
+ * Bytes of BUDDY_NOHEADER side table for nchunks chunks of 2^kval bytes.
+ */
+static size_t meta_size(unsigned short int kval, unsigned int nchunks) {
+	return (nchunks * (UINT64_C(1) << kval)) >> MIN_KVAL;
+}
+
+
+/**
+ * Bytes of slab bitmap for nchunks chunks of 2^kval bytes.
+ */
+static size_t slabmap_size(unsigned short int kval, unsigned int nchunks) {
+	size_t bits = (nchunks * (UINT64_C(1) << kval)) >> SLAB_KVAL;
+
+	return ((bits + 63) / 64) * sizeof(uint64_t);
+}
+
+
+/**
+ * Bytes of sampled bitmap for nchunks chunks of 2^kval bytes.
+ */
+static size_t sampledmap_size(unsigned short int kval, unsigned int nchunks) {
+	size_t bits = (nchunks * (UINT64_C(1) << kval)) >> MIN_KVAL;
+
+	return ((bits + 63) / 64) * sizeof(uint64_t);
+}
+
+
+#ifdef BUDDY_HARDENED
+static void harden_init(void);
+static void harden_slab(struct slab *s);
+static void quarantine_drop(struct buddy_arena *pool);
+#endif
+
+/**
+ * Maps a pool of the given size (0 for the default) and sets up its lists with
+ * the whole first chunk as one available block. Returns FALSE if the size is too
+ * large or the memory cannot be mapped.
+ */
+static int pool_init(struct buddy_arena *pool, size_t size, int flags) {
+	unsigned short int kval = pool_kval(size, flags);
+	if (kval == 0) {
+		return FALSE;
+	}
+#ifdef BUDDY_HARDENED
+	harden_init();
+#endif
+
+	// a growable pool reserves as many chunks as the address space budget allows
+	unsigned int maxchunks = 1;
+	if (flags & BUDDY_GROWABLE) {
+		maxchunks = GROW_MAX_CHUNKS;
+		while (maxchunks > 1 && kval + get_kval(maxchunks) > GROW_MAX_RESERVE_KVAL) {
+			maxchunks >>= 1;
+		}
+	}
+
+	char *start = pool_reserve(kval, maxchunks);
+	if (start == NULL) {
+		return FALSE;
+	}
+	if (!chunk_map(start, kval, flags)) {
+		munmap(start, maxchunks * (UINT64_C(1) << kval));
+		return FALSE;
+	}
+
+	// the side table covers every chunk and, like the pool, is only faulted in where used
+	pool->meta = NULL;
+	if (flags & BUDDY_NOHEADER) {
+		pool->meta = mmap(NULL, meta_size(kval, maxchunks), PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (pool->meta == MAP_FAILED) {
+			munmap(start, maxchunks * (UINT64_C(1) << kval));
+			return FALSE;
+		}
+	}
+
+	// pools too small for a slab serve small requests from the lists
+	pool->slabmap = NULL;
+	if (!(flags & BUDDY_NOSLAB) && kval >= SLAB_KVAL) {
+		pool->slabmap = mmap(NULL, slabmap_size(kval, maxchunks), PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (pool->slabmap == MAP_FAILED) {
+			if (pool->meta != NULL) {
+				munmap(pool->meta, meta_size(kval, maxchunks));
+			}
+			munmap(start, maxchunks * (UINT64_C(1) << kval));
+			return FALSE;
+		}
+	}
+
+	// the profiler's marks stay off the blocks' headers, and untouched until it runs
+	pool->sampledmap = mmap(NULL, sampledmap_size(kval, maxchunks), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (pool->sampledmap == MAP_FAILED) {
+		if (pool->slabmap != NULL) {
+			munmap(pool->slabmap, slabmap_size(kval, maxchunks));
+		}
+		if (pool->meta != NULL) {
+			munmap(pool->meta, meta_size(kval, maxchunks));
+		}
+		munmap(start, maxchunks * (UINT64_C(1) << kval));
+		return FALSE;
+	}
+
+	pool->start = start; // sets start address for memory block
+	pool->size = UINT64_C(1) << kval;
+	pool->maxchunks = maxchunks;
+	pool->chunkmap = 1;
+	pthread_mutex_init(&pool->chunk_lock, NULL);
+
+	// set the rest of pool variables and create initial block_header
+	pool->lgsize = kval;	
+	pool->flags = flags;
+	pool->pagekval = pool_page_kval(flags);
+	pool->purgekval = pool->pagekval + 1 > PURGE_MIN_KVAL ? pool->pagekval + 1 : PURGE_MIN_KVAL;
+	pool->availmap = 0;
+	pool->freed = NULL;
+	pool->background = FALSE;
+	
+	size_t i = 0;
+
+	memset(&pool->counters, 0, sizeof(pool->counters));
+	for (i = 0; i < MAX_KVAL; i++) {
+		pool->locks[i].lazy = 0;
+		pool->locks[i].nfree = 0;
+	}
+
+	if (flags & BUDDY_THREADSAFE) {
+		pthread_mutex_init(&pool->worker_lock, NULL);
+		pthread_cond_init(&pool->worker_wake, NULL);
+		for (i = 0; i < MAX_KVAL; i++) {
+			pthread_mutex_init(&pool->locks[i].mutex, NULL);
+		}
+		for (i = 0; i < SLAB_CLASSES; i++) {
+			pthread_mutex_init(&pool->slabs[i].mutex, NULL);
+		}
+	}
+
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		pool->slabs[i].partial.next = pool->slabs[i].partial.prev = &pool->slabs[i].partial;
+		pool->slabs[i].partial.tag = UNUSED;
+		pool->slabs[i].nslabs = pool->slabs[i].free_slots = 0;
+	}
+
+	// create block headers up to kval index
+	for(i = 0; i < kval; i++) {
+		pool->avail[i].next = pool->avail[i].prev = &pool->avail[i]; // set next and prev pointers to self for malloc algorithm
+		pool->avail[i].kval = i; // set kval to curr.
+		pool->avail[i].tag = UNUSED; 
+	}
+
+	// set kval index block header
+	pool->avail[kval].next = pool->avail[kval].prev = &pool->avail[kval];
+	pool->avail[kval].kval = kval;
+	pool->avail[kval].tag = UNUSED;
+	avail_push(pool, (struct block_header *)pool->start, kval, BLOCK_ZERO); // fresh pages read as zero
+
+	return TRUE;
+}
+
+
+static void worker_stop(struct buddy_arena *pool);
+static void profile_drop(struct buddy_arena *pool);
+
+/**
+ * Unmaps every chunk of pool along with the address space reserved for more.
+ */
+static void pool_destroy(struct buddy_arena *pool) {
+	int i;
+
+#ifdef BUDDY_HARDENED
+	quarantine_drop(pool);
+#endif
+	worker_stop(pool);
+	profile_drop(pool);
+	munmap(pool->start, pool->maxchunks * pool->size);
+	if (pool->meta != NULL) {
+		munmap(pool->meta, meta_size(pool->lgsize, pool->maxchunks));
+	}
+	if (pool->slabmap != NULL) {
+		munmap(pool->slabmap, slabmap_size(pool->lgsize, pool->maxchunks));
+	}
+	munmap(pool->sampledmap, sampledmap_size(pool->lgsize, pool->maxchunks));
+	pthread_mutex_destroy(&pool->chunk_lock);
+	if (pool->flags & BUDDY_THREADSAFE) {
+		pthread_mutex_destroy(&pool->worker_lock);
+		pthread_cond_destroy(&pool->worker_wake);
+		for (i = 0; i < MAX_KVAL; i++) {
+			pthread_mutex_destroy(&pool->locks[i].mutex);
+		}
+		for (i = 0; i < SLAB_CLASSES; i++) {
+			pthread_mutex_destroy(&pool->slabs[i].mutex);
+		}
+	}
+}
+
+
+/**
+ * Takes every lock of a BUDDY_THREADSAFE pool, in the order threads nest them:
+ * slab classes, then the worker lock, then the chunk lock, then the orders.
+ */
+static void pool_lock_all(struct buddy_arena *pool) {
+	int i;
+
+	if (!(pool->flags & BUDDY_THREADSAFE)) {
+		return;
+	}
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		pthread_mutex_lock(&pool->slabs[i].mutex);
+	}
+	pthread_mutex_lock(&pool->worker_lock);
+	pthread_mutex_lock(&pool->chunk_lock);
+	for (i = 0; i < MAX_KVAL; i++) {
+		pthread_mutex_lock(&pool->locks[i].mutex);
+	}
+}
+
+
+static void pool_unlock_all(struct buddy_arena *pool) {
+	int i;
+
+	if (!(pool->flags & BUDDY_THREADSAFE)) {
+		return;
+	}
+	for (i = MAX_KVAL - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&pool->locks[i].mutex);
+	}
+	pthread_mutex_unlock(&pool->chunk_lock);
+	pthread_mutex_unlock(&pool->worker_lock);
+	for (i = SLAB_CLASSES - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&pool->slabs[i].mutex);
+	}
+}
+
+
+/*
+ * Fork handlers: no other thread may hold a pool lock at fork, or the child
+ * would find it locked forever. The child keeps every block, including those
+ * cached by threads it does not inherit, and those queued for a worker thread
+ * it does not inherit either: its allocations merge them once they run short.
+ */
+static void fork_prepare(void) {
+	struct buddy_arena *pool;
+
+#ifdef BUDDY_HARDENED
+	pthread_mutex_lock(&quarantine_lock);
+#endif
+	pthread_mutex_lock(&arenas_lock);
+	pthread_mutex_lock(&tcaches_lock);
+	if (initialized) {
+		pool_lock_all(&mempool);
+	}
+	for (pool = arenas; pool != NULL; pool = pool->next_arena) {
+		pool_lock_all(pool);
+	}
+	pthread_mutex_lock(&profile_lock);
+}
+
+
+static void fork_release(void) {
+	struct buddy_arena *pool;
+
+	pthread_mutex_unlock(&profile_lock);
+	for (pool = arenas; pool != NULL; pool = pool->next_arena) {
+		pool_unlock_all(pool);
+	}
+	if (initialized) {
+		pool_unlock_all(&mempool);
+	}
+	pthread_mutex_unlock(&tcaches_lock);
+	pthread_mutex_unlock(&arenas_lock);
+#ifdef BUDDY_HARDENED
+	pthread_mutex_unlock(&quarantine_lock);
+#endif
+}
+
+
+/* the child has no worker thread */
+static void worker_forget(struct buddy_arena *pool) {
+	if (pool->flags & BUDDY_THREADSAFE) {
+		pool->background = FALSE;
+		pthread_cond_init(&pool->worker_wake, NULL);
+	}
+}
+
+
+static void fork_child(void) {
+	struct buddy_arena *pool;
+
+	for (pool = arenas; pool != NULL; pool = pool->next_arena) {
+		worker_forget(pool);
+	}
+	if (initialized) {
+		worker_forget(&mempool);
+	}
+	fork_release();
+}
+
+
+static void atfork_register(void) {
+	pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+
+
+int buddy_init(size_t size) {
+	return buddy_init_flags(size, 0);
+}
+
+
+int buddy_init_flags(size_t size, int flags) {
+	// re-initializing replaces the old pool, and with it what the thread caches hold
+	if (initialized) {
+		pool_destroy(&mempool);
+		initialized = FALSE;
+	}
+	__atomic_add_fetch(&pool_generation, 1, __ATOMIC_RELAXED);
+
+	// check if mmap failed:
+	if (!pool_init(&mempool, size, flags)) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	if (flags & BUDDY_THREADSAFE) {
+		pthread_once(&tcache_once, tcache_key_create);
+		pthread_once(&atfork_once, atfork_register);
+	}
+
+	// the counters of threads start over with the pool too; live caches reset theirs in tcache_forget
+	pthread_mutex_lock(&tcaches_lock);
+	memset(&tcache_exited, 0, sizeof(tcache_exited));
+	pthread_mutex_unlock(&tcaches_lock);
+
+	initialized = TRUE;
+    return TRUE;
+}
+
+
+buddy_arena_t *buddy_arena_create(size_t size) {
+	return buddy_arena_create_flags(size, 0);
+}
+
+
+buddy_arena_t *buddy_arena_create_flags(size_t size, int flags) {
+	// the arena's own structure lives outside its pool
+	struct buddy_arena *pool = mmap(NULL, sizeof(struct buddy_arena), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (pool == MAP_FAILED) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (!pool_init(pool, size, flags)) {
+		munmap(pool, sizeof(struct buddy_arena));
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (flags & BUDDY_THREADSAFE) {
+		pthread_once(&atfork_once, atfork_register);
+	}
+	pthread_mutex_lock(&arenas_lock);
+	pool->next_arena = arenas;
+	arenas = pool;
+	pthread_mutex_unlock(&arenas_lock);
+
+	return pool;
+}
+
+
+void buddy_arena_destroy(buddy_arena_t *pool) {
+	struct buddy_arena **prev;
+
+	if (pool == NULL || pool == &mempool) {
+		return;
+	}
+
+	pthread_mutex_lock(&arenas_lock);
+	for (prev = &arenas; *prev != pool; prev = &(*prev)->next_arena) {
+		;
+	}
+	*prev = pool->next_arena;
+	pthread_mutex_unlock(&arenas_lock);
+
+	pool_destroy(pool);
+	munmap(pool, sizeof(struct buddy_arena));
+}
+
+
+/**
+ * Maps one more chunk into a BUDDY_GROWABLE pool that has no block of order kval
+ * or more left, and returns it whole as a reserved block of order lgsize. Under
+ * the chunk lock the lists are searched once more first, in case another thread
+ * grew the pool meanwhile; such a block is returned with its order in *j.
+ * Returns NULL when the reserved address space is full or mapping fails.
+ */
+static struct block_header *pool_grow(struct buddy_arena *pool, unsigned short int kval, unsigned short int *j) {
+	struct block_header *L;
+
+	if (!(pool->flags & BUDDY_GROWABLE)) {
+		return NULL;
+	}
+
+	pool_mutex_lock(pool, &pool->chunk_lock);
+	L = avail_take(pool, kval, j);
+	if (L == NULL) {
+		uint64_t unmapped = ~pool->chunkmap & ((pool->maxchunks == 64 ? 0 : UINT64_C(1) << pool->maxchunks) - 1);
+
+		if (unmapped != 0) {
+			unsigned int i = __builtin_ctzll(unmapped);
+			char *chunk = (char *) pool->start + i * pool->size;
+
+			if (chunk_map(chunk, pool->lgsize, pool->flags)) {
+				__atomic_fetch_or(&pool->chunkmap, UINT64_C(1) << i, __ATOMIC_RELAXED);
+				L = (struct block_header *) chunk;
+				L->flags = BLOCK_ZERO;
+				set_state(pool, L, RESERVED, pool->lgsize);
+				*j = pool->lgsize;
+			}
+		}
+	}
+	pool_mutex_unlock(pool, &pool->chunk_lock);
+
+	return L;
+}
+
+
+/**
+ * Gives the whole free chunk L of a BUDDY_GROWABLE pool back to the OS. The
+ * first chunk stays, so the pool never shrinks below its initial size.
+ * Returns FALSE if L is kept.
+ */
+static int pool_shrink(struct buddy_arena *pool, struct block_header *L) {
+	unsigned int i = ((char *) L - (char *) pool->start) >> pool->lgsize;
+
+	if (!(pool->flags & BUDDY_GROWABLE) || i == 0) {
+		return FALSE;
+	}
+
+	pool_mutex_lock(pool, &pool->chunk_lock);
+	chunk_unmap((char *) L, pool->lgsize);
+	// a chunk's slice of the side table is aligned to its size; one under a page shares it with others
+	if (pool->meta != NULL && meta_size(pool->lgsize, 1) >= (UINT64_C(1) << pool_min_kval(0))) {
+		pool_purge(meta_of(pool, L), meta_size(pool->lgsize, 1));
+	}
+	__atomic_fetch_and(&pool->chunkmap, ~(UINT64_C(1) << i), __ATOMIC_RELAXED);
+	pool_mutex_unlock(pool, &pool->chunk_lock);
+
+	return TRUE;
+}
+
+
+static int lazy_coalesce(struct buddy_arena *pool, unsigned short int kval);
+static int worker_drain(struct buddy_arena *pool);
+static int tcache_drain(struct buddy_arena *pool);
+
+/**
+ * Algorithm R (buddy system reservation) on the shared lists. Returns the block L
+ * reserved at order kval, or NULL when no list of order >= kval has a block.
+ */
+static struct block_header *reserve(struct buddy_arena *pool, unsigned short int kval)
+{
+	/* Now we begin following Algorithm R (Buddu system reservation) as closely as possible */
+
+	//1. (find block): let j be the smallest int in range k <=j<= m in which AVAILF[j] != LOC(AVAIL[j]
+	//2. (remove from list): set L=AVAILF[j], P=LINKF(L), AVAILF[j] = P, LINKB(P) = LOC(AVAIL[j]) and TAG(L)=0
+	unsigned short int j;
+	struct block_header *L = avail_take(pool, kval, &j);
+
+	// blocks freed but not merged yet, by the worker or lazily, or still in this thread's cache, may make up one
+	while (L == NULL && (worker_drain(pool) || lazy_coalesce(pool, kval) || tcache_drain(pool))) {
+		L = avail_take(pool, kval, &j);
+	}
+	if(L == NULL && (L = pool_grow(pool, kval, &j)) == NULL) {
+		return NULL;
+	}
+
+	//3. Check if split is required: If j=k, terminate(we have found and reserved an available block at address L)
+
+	//4. Split: Decrement j, set P=L+2^j, Tag(P)=1, kval(P)=j, LINKF(P)=LINKB(P)=LOC(AVAIL[j]), AVAILF[j]=AVAILB[j]=P.
+	// halves of a block known to be zero are too
+	if (j != kval) {
+		count_splits(pool, j - kval);
+	}
+	while(j!=kval) {
+		j--;
+		struct block_header *P = (struct block_header *) (((uint_least64_t) L) + (UINT64_C(1) << j));
+		order_lock(pool, j);
+		avail_push(pool, P, j, L->flags);
+		order_unlock(pool, j);
+	}
+
+	set_state(pool, L, RESERVED, kval);
+	return L;
+}
+
+
+/**
+ * Reserves up to n blocks of order kval into out[]. Once AVAIL[kval] runs dry, one
+ * larger block is split only as far as needed and the remainder carved straight
+ * into order-kval blocks, rather than running Algorithm R once per block.
+ * Returns the number of blocks reserved.
+ */
+static unsigned int reserve_batch(struct buddy_arena *pool, unsigned short int kval, unsigned int n, struct block_header **out)
+{
+	unsigned int got = 0;
+
+	while (got < n) {
+		order_lock(pool, kval);
+		while (got < n && pool->avail[kval].next != &pool->avail[kval]) {
+			struct block_header *L = pool->avail[kval].next;
+			avail_unlink(pool, L, kval);
+			out[got++] = L;
+		}
+		order_unlock(pool, kval);
+
+		if (got == n) {
+			break;
+		}
+
+		unsigned short int j;
+		struct block_header *L = avail_take(pool, kval + 1, &j);
+		if (L == NULL && (worker_drain(pool) || lazy_coalesce(pool, kval + 1) || tcache_drain(pool))) {
+			continue;
+		}
+		if (L == NULL && (L = pool_grow(pool, kval + 1, &j)) == NULL) {
+			break;
+		}
+
+		// split off upper halves until L holds no more blocks than are still wanted
+		while (j > kval && (UINT64_C(1) << (j - kval)) > n - got) {
+			j--;
+			count_splits(pool, 1);
+			order_lock(pool, j);
+			avail_push(pool, (struct block_header *) (((uint_least64_t) L) + (UINT64_C(1) << j)), j, L->flags);
+			order_unlock(pool, j);
+		}
+
+		// carve the rest of L into blocks of order kval, one split fewer than blocks
+		count_splits(pool, (UINT64_C(1) << (j - kval)) - 1);
+		uint64_t i;
+		for (i = 0; i < (UINT64_C(1) << (j - kval)); i++) {
+			struct block_header *B = (struct block_header *) (((uint_least64_t) L) + (i << kval));
+			B->flags = L->flags;
+			set_state(pool, B, RESERVED, kval);
+			out[got++] = B;
+		}
+	}
+
+	return got;
+}
+
+
+/**
+ * Empties a cache filled from a pool that buddy_init_flags has since replaced.
+ * Its blocks went away with that pool, and its counters start over at zero;
+ * pool_stats skips them until the generation says they belong to the new pool.
+ */
+static void tcache_forget(struct tcache *tc)
+{
+	memset(tc->head, 0, sizeof(tc->head));
+	memset(tc->count, 0, sizeof(tc->count));
+	memset(tc->slot, 0, sizeof(tc->slot));
+	memset(tc->nslot, 0, sizeof(tc->nslot));
+	memset(&tc->counters, 0, sizeof(tc->counters));
+	__atomic_store_n(&tc->generation, __atomic_load_n(&pool_generation, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Returns the calling thread's cache, registering it for the exit destructor on first use.
+ */
+static struct tcache *tcache_get(void)
+{
+	struct tcache *tc = &tcache;
+
+	// marked first: pthread_setspecific may allocate, and that call must not come back here
+	if (!tc->registered) {
+		tc->registered = TRUE;
+		pthread_setspecific(tcache_key, tc);
+		pthread_mutex_lock(&tcaches_lock);
+		tc->next_tcache = tcaches;
+		tcaches = tc;
+		pthread_mutex_unlock(&tcaches_lock);
+	}
+	if (tc->generation != __atomic_load_n(&pool_generation, __ATOMIC_RELAXED)) {
+		tcache_forget(tc);
+	}
+	return tc;
+}
+
+
+/**
+ * Moves a batch of order kval blocks from the shared lists into the thread's cache.
+ */
+static void tcache_refill(struct tcache *tc, unsigned short int kval)
+{
+	struct block_header *batch[TCACHE_BATCH];
+	unsigned int i, n;
+
+	n = reserve_batch(&mempool, kval, TCACHE_BATCH, batch);
+
+	for (i = 0; i < n; i++) {
+		batch[i]->next = tc->head[kval];
+		tc->head[kval] = batch[i];
+	}
+	tc->count[kval] += n;
+}
+
+
+/**
+ * TRUE if pool has per-thread caches. Only the default arena has them: an
+ * arena may be destroyed while other threads would still cache its blocks.
+ */
+static int has_tcache(struct buddy_arena *pool) {
+	return pool == &mempool && (pool->flags & BUDDY_THREADSAFE);
+}
+
+
+/**
+ * TRUE if blocks of order kval in pool go through the calling thread's cache.
+ */
+static int uses_tcache(struct buddy_arena *pool, unsigned short int kval) {
+	return has_tcache(pool) && kval <= TCACHE_MAX_KVAL;
+}
+
+
+static void release(struct buddy_arena *pool, struct block_header *L, unsigned short int kval);
+
+/**
+ * Size class of a request of at most SLAB_MAX_SIZE bytes: sizes in
+ * (2^(k-1), 2^k] go to class 2^k, or from 64 bytes on to 3*2^(k-2) if they fit.
+ */
+static unsigned int slab_class_of(size_t size) {
+	unsigned int k = kval_of(size);
+
+	if (k <= 3) {
+		return 0;
+	}
+	if (k <= 5) {
+		return k - 3;
+	}
+	return size <= (UINT64_C(3) << (k - 2)) ? 2*k - 9 : 2*k - 8;
+}
+
+
+/**
+ * The slab holding ptr, or NULL if ptr is a block from the lists.
+ */
+static struct slab *slab_of(struct buddy_arena *pool, void *ptr) {
+	size_t i = ((char *) ptr - (char *) pool->start) >> SLAB_KVAL;
+
+	if (pool->slabmap == NULL) {
+		return NULL;
+	}
+	if (!(__atomic_load_n(&pool->slabmap[i / 64], __ATOMIC_RELAXED) & (UINT64_C(1) << (i % 64)))) {
+		return NULL;
+	}
+	return (struct slab *) ((uint_least64_t) ptr & ~((UINT64_C(1) << SLAB_KVAL) - 1));
+}
+
+
+/**
+ * Links slab s at the front of its class's partial list. Caller holds the class lock.
+ */
+static void slab_link(struct buddy_arena *pool, struct slab *s) {
+	struct block_header *head = &pool->slabs[s->cls].partial;
+
+	s->block.next = head->next;
+	s->block.prev = head;
+	head->next->prev = &s->block;
+	head->next = &s->block;
+}
+
+
+static void slab_unlink(struct slab *s) {
+	s->block.prev->next = s->block.next;
+	s->block.next->prev = s->block.prev;
+}
+
+
+/**
+ * Reserves a block of order SLAB_KVAL and lays out slots of class cls in it.
+ * Power-of-two slots are aligned to their size, the others to 16 bytes. The new
+ * slab goes on the partial list. Caller holds the class lock. Returns NULL when
+ * the lists have no block for it.
+ */
+static struct slab *slab_new(struct buddy_arena *pool, unsigned int cls) {
+	size_t size = slab_sizes[cls];
+	size_t align = (size & (size - 1)) == 0 ? size : 16;
+	struct slab *s = (struct slab *) reserve(pool, SLAB_KVAL);
+	unsigned int i;
+
+	if (s == NULL) {
+		return NULL;
+	}
+
+	s->cls = cls;
+#ifdef BUDDY_HARDENED
+	// the slots' stamps, see harden_alloc, go between the header and the first slot
+	s->nslots = ((UINT64_C(1) << SLAB_KVAL) - sizeof(struct slab) - align) / (size + sizeof(uint16_t));
+	s->offset = (sizeof(struct slab) + s->nslots * sizeof(uint16_t) + align - 1) & ~(align - 1);
+	s->recip = (UINT64_C(1) << 32) / size + 1;
+#else
+	s->offset = (sizeof(struct slab) + align - 1) & ~(align - 1);
+	s->nslots = ((UINT64_C(1) << SLAB_KVAL) - s->offset) / size;
+#endif
+	s->nfree = s->nslots;
+	s->hint = 0;
+	memset(s->freemap, 0, sizeof(s->freemap));
+	for (i = 0; i < s->nslots; i++) {
+		s->freemap[i / 64] |= UINT64_C(1) << (i % 64);
+	}
+#ifdef BUDDY_HARDENED
+	harden_slab(s);
+#endif
+
+	i = ((char *) s - (char *) pool->start) >> SLAB_KVAL;
+	__atomic_fetch_or(&pool->slabmap[i / 64], UINT64_C(1) << (i % 64), __ATOMIC_RELAXED);
+	slab_link(pool, s);
+	__atomic_store_n(&pool->slabs[cls].nslabs, pool->slabs[cls].nslabs + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool->slabs[cls].free_slots, pool->slabs[cls].free_slots + s->nslots, __ATOMIC_RELAXED);
+	return s;
+}
+
+
+/**
+ * Hands out up to n slots of class cls into out[], filling the partial slabs
+ * first and taking new slabs from the lists once they run out. Returns the
+ * number of slots handed out.
+ */
+static unsigned int slab_alloc(struct buddy_arena *pool, unsigned int cls, unsigned int n, void **out) {
+	struct block_header *head = &pool->slabs[cls].partial;
+	unsigned int got = 0;
+
+	pool_mutex_lock(pool, &pool->slabs[cls].mutex);
+	while (got < n) {
+		struct slab *s = (struct slab *) head->next;
+
+		if (head->next == head && (s = slab_new(pool, cls)) == NULL) {
+			break;
+		}
+
+		while (got < n && s->nfree > 0) {
+			unsigned int w = s->hint;
+			unsigned int b;
+
+			while (s->freemap[w] == 0) {
+				w++;
+			}
+			b = __builtin_ctzll(s->freemap[w]);
+			s->freemap[w] &= s->freemap[w] - 1;
+			s->hint = w;
+			s->nfree--;
+			out[got++] = (char *) s + s->offset + (w * 64 + b) * slab_sizes[cls];
+		}
+
+		if (s->nfree == 0) {
+			slab_unlink(s);
+		}
+	}
+	__atomic_store_n(&pool->slabs[cls].free_slots, pool->slabs[cls].free_slots - got, __ATOMIC_RELAXED);
+	pool_mutex_unlock(pool, &pool->slabs[cls].mutex);
+
+	return got;
+}
+
+
+/**
+ * Returns the n slots ptr[] to slab s under one hold of the class lock. A slab
+ * whose last slot comes back goes back to the lists, unless it is the only
+ * partial slab of its class: keeping one spare stops a single object allocated
+ * and freed in a loop from splitting and merging a block each time. In a
+ * BUDDY_GROWABLE pool only the first chunk, which is never unmapped, keeps a
+ * spare; elsewhere it could keep an otherwise free chunk mapped.
+ */
+static void slab_free(struct buddy_arena *pool, struct slab *s, void **ptr, unsigned int n) {
+	unsigned int cls = s->cls;
+	unsigned int i;
+
+	pool_mutex_lock(pool, &pool->slabs[cls].mutex);
+	if (s->nfree == 0) {
+		slab_link(pool, s);
+	}
+	while (n-- > 0) {
+		i = ((char *) ptr[n] - (char *) s - s->offset) / slab_sizes[cls];
+		s->freemap[i / 64] |= UINT64_C(1) << (i % 64);
+		if (i / 64 < s->hint) {
+			s->hint = i / 64;
+		}
+		s->nfree++;
+		__atomic_store_n(&pool->slabs[cls].free_slots, pool->slabs[cls].free_slots + 1, __ATOMIC_RELAXED);
+	}
+
+	if (s->nfree == s->nslots && (s->block.next != &pool->slabs[cls].partial || s->block.prev != &pool->slabs[cls].partial
+			|| ((char *) s - (char *) pool->start) >> pool->lgsize != 0)) {
+		slab_unlink(s);
+		i = ((char *) s - (char *) pool->start) >> SLAB_KVAL;
+		__atomic_fetch_and(&pool->slabmap[i / 64], ~(UINT64_C(1) << (i % 64)), __ATOMIC_RELAXED);
+		__atomic_store_n(&pool->slabs[cls].nslabs, pool->slabs[cls].nslabs - 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&pool->slabs[cls].free_slots, pool->slabs[cls].free_slots - s->nslots, __ATOMIC_RELAXED);
+		pool_mutex_unlock(pool, &pool->slabs[cls].mutex);
+		release(pool, &s->block, SLAB_KVAL);
+		return;
+	}
+	pool_mutex_unlock(pool, &pool->slabs[cls].mutex);
+}
+
+
+/**
+ * Allocates a slot of class cls, from the calling thread's cache when the pool has one.
+ */
+static void *slab_malloc(struct buddy_arena *pool, unsigned int cls) {
+	void *ptr;
+
+	if (has_tcache(pool)) {
+		struct tcache *tc = tcache_get();
+		void *batch[TCACHE_BATCH];
+		unsigned int i, n;
+
+		if (tc->slot[cls] == NULL) {
+			n = slab_alloc(pool, cls, TCACHE_BATCH, batch);
+			for (i = 0; i < n; i++) {
+				*(void **) batch[i] = tc->slot[cls];
+				tc->slot[cls] = batch[i];
+			}
+			tc->nslot[cls] += n;
+		}
+		ptr = tc->slot[cls];
+		if (ptr != NULL) {
+			tc->slot[cls] = *(void **) ptr;
+			tc->nslot[cls]--;
+		}
+		return ptr;
+	}
+
+	return slab_alloc(pool, cls, 1, &ptr) == 1 ? ptr : NULL;
+}
+
+
+/**
+ * The block holding ptr, which is not in a slab. In a pool with headers an
+ * aligned pointer sits further into its block, behind a second header tagged
+ * ALIGNED that holds the block's order; the block starts at ptr rounded down to
+ * that order.
+ */
+static struct block_header *block_of(struct buddy_arena *pool, void *ptr) {
+	struct block_header *L = (struct block_header *) ((char *) ptr - header_size(pool));
+
+	if (header_size(pool) != 0 && L->tag == ALIGNED) {
+		L = (struct block_header *) ((uint_least64_t) ptr & ~((UINT64_C(1) << L->kval) - 1));
+	}
+	return L;
+}
+
+
+/**
+ * Bytes the caller may use at ptr.
+ */
+static size_t usable_size(struct buddy_arena *pool, void *ptr) {
+	struct slab *s = slab_of(pool, ptr);
+	struct block_header *L;
+
+	if (s != NULL) {
+		return slab_sizes[s->cls];
+	}
+	L = block_of(pool, ptr);
+	return (UINT64_C(1) << block_kval(pool, L)) - ((char *) ptr - (char *) L);
+}
+
+
+/*
+ * Built with -DBUDDY_HARDENED, every allocation is stamped with the requested
+ * size xor a cookie of the pointer and a per-process secret, and followed by
+ * guard bytes of GUARD_BYTE right after the requested size. A slot keeps its
+ * stamp, 16 bits wide, in an array in front of the slab's slots, 32 to a cache
+ * line, and its guard in what the request leaves of the slot, up to
+ * HARDEN_GUARD bytes: the class is that of the request, and a request filling
+ * its slot has no guard. A block with a header keeps the stamp in the header's
+ * next field, unused while it is reserved, and a block without one in a
+ * trailer, its last 8 bytes; both are padded by harden_pad() for HARDEN_GUARD
+ * bytes of guard and the trailer.
+ *
+ * Freeing or resizing checks, before anything is written, that the pointer is
+ * inside a mapped chunk, is the start of a slot or the pointer of a reserved
+ * block with a sane order, that the stamp and the guard bytes are intact, and
+ * aborts with a message otherwise. A freed stamp holds FREED_MARK, or
+ * SLOT_FREED for a slot, which tells a double free from an overflow; a new
+ * slab's slots start out stamped freed.
+ */
+#ifdef BUDDY_HARDENED
+
+#define HARDEN_GUARD sizeof(uint64_t)
+#define GUARD_BYTE 0xab
+#define GUARD_WORD (UINT64_C(0x0101010101010101) * GUARD_BYTE)
+#define FREED_MARK UINT64_C(0xf5eef5eef5eef5ee)
+#define SLOT_FREED 0xf5ee /* larger than any class */
+
+static uint64_t harden_secret;
+static size_t quarantine_limit; // see buddy_quarantine, 0 while the quarantine is off
+
+static void harden_init(void)
+{
+	uint64_t secret = 0, expected = 0;
+
+	if (__atomic_load_n(&harden_secret, __ATOMIC_RELAXED) != 0) {
+		return;
+	}
+	if (syscall(SYS_getrandom, &secret, sizeof(secret), 0) != sizeof(secret)) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		secret = ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) ^ (uintptr_t) &secret ^ ((uint64_t) getpid() << 32);
+	}
+	__atomic_compare_exchange_n(&harden_secret, &expected, secret | 1, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+static uint64_t harden_cookie(void *ptr)
+{
+	return harden_secret ^ ((uintptr_t) ptr * UINT64_C(0x9e3779b97f4a7c15));
+}
+
+
+static void __attribute__((noreturn, cold)) harden_fail(const char *call, void *ptr, const char *what)
+{
+	fprintf(stderr, "%s(%p): %s\n", call, ptr, what);
+	abort();
+}
+
+
+/* bytes a block is padded by for its guard, and its trailer if it has no header */
+static size_t harden_pad(struct buddy_arena *pool)
+{
+	return HARDEN_GUARD + (header_size(pool) == 0 ? sizeof(uint64_t) : 0);
+}
+
+
+/* TRUE if ptr, not NULL, is stamped in a trailer */
+static int has_trailer(struct buddy_arena *pool, void *ptr)
+{
+	return header_size(pool) == 0 && slab_of(pool, ptr) == NULL;
+}
+
+
+/**
+ * Index of the slot at offset bytes past the first one of slab s, rounded
+ * down. Multiplying by the slab's recip is exact for offsets within a slab,
+ * and spares a division on every allocation and free.
+ */
+static size_t slot_index(struct slab *s, size_t offset)
+{
+	return (offset * s->recip) >> 32;
+}
+
+
+/* the stamp of slot i of slab s */
+static uint16_t *slot_stamp(struct slab *s, size_t i)
+{
+	return (uint16_t *) (s + 1) + i;
+}
+
+
+/* stamps the slots of the new slab s freed, so that freeing one never handed out is a double free */
+static void harden_slab(struct slab *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->nslots; i++) {
+		*slot_stamp(s, i) = (uint16_t) (SLOT_FREED ^ harden_cookie((char *) s + s->offset + i * slab_sizes[s->cls]));
+	}
+}
+
+
+/**
+ * The 8 bytes ending with the guard of a slot of slot_size bytes at ptr holding
+ * size bytes, and in *mask the guard's bytes among them. The guard is as long
+ * as the slot leaves room for, up to HARDEN_GUARD bytes; going through a whole
+ * word keeps its length, which differs from one request to the next, off branches.
+ */
+static char *slot_guard(size_t slot_size, void *ptr, size_t size, uint64_t *mask)
+{
+	size_t n = slot_size - size < HARDEN_GUARD ? slot_size - size : HARDEN_GUARD;
+
+	*mask = ~((~UINT64_C(0) >> 4 * n) >> 4 * n);
+	return (char *) ptr + size + n - sizeof(uint64_t);
+}
+
+
+/**
+ * Guards and stamps the slot ptr, see harden_stamp. It is known to be a slot,
+ * so its slab is ptr rounded down, without a look at the pool's slab map.
+ */
+static inline __attribute__((always_inline)) void *harden_stamp_slot(void *ptr, size_t size, int resized)
+{
+	struct slab *s = (struct slab *) ((uint_least64_t) ptr & ~((UINT64_C(1) << SLAB_KVAL) - 1));
+	uint64_t mask, word = GUARD_WORD;
+	char *g = slot_guard(slab_sizes[s->cls], ptr, size, &mask);
+
+	if (resized) {
+		memcpy(&word, g, sizeof(word));
+		word = (word & ~mask) | (GUARD_WORD & mask);
+	}
+	memcpy(g, &word, sizeof(word));
+	*slot_stamp(s, slot_index(s, (char *) ptr - (char *) s - s->offset)) = (uint16_t) (size ^ harden_cookie(ptr));
+	return ptr;
+}
+
+
+/**
+ * Guards and stamps ptr, handed out or resized in place for a request of size
+ * bytes, which for a block was padded by harden_pad(). Returns ptr. A new slot
+ * holds nothing yet, so its guard's word is stored without reading what it
+ * overlaps; a slot that was resized keeps those bytes.
+ */
+static void *harden_stamp(struct buddy_arena *pool, void *ptr, size_t size, int resized)
+{
+	if (ptr == NULL) {
+		return NULL;
+	}
+	if (slab_of(pool, ptr) != NULL) {
+		return harden_stamp_slot(ptr, size, resized);
+	}
+
+	memset((char *) ptr + size, GUARD_BYTE, HARDEN_GUARD);
+	if (header_size(pool) == 0) {
+		*(uint64_t *) ((char *) ptr + usable_size(pool, ptr) - sizeof(uint64_t)) = size ^ harden_cookie(ptr);
+	} else {
+		block_of(pool, ptr)->next = (struct block_header *) (uintptr_t) (size ^ harden_cookie(ptr));
+	}
+	return ptr;
+}
+
+
+static void *harden_alloc(struct buddy_arena *pool, void *ptr, size_t size)
+{
+	return harden_stamp(pool, ptr, size, FALSE);
+}
+
+
+/* harden_alloc() of a slot */
+static inline __attribute__((always_inline)) void *harden_alloc_slot(void *ptr, size_t size)
+{
+	return harden_stamp_slot(ptr, size, FALSE);
+}
+
+
+/**
+ * slab_of() a ptr passed to call, which is aborted unless ptr is in the pool.
+ */
+static inline __attribute__((always_inline)) struct slab *harden_slab_of(struct buddy_arena *pool, void *ptr, const char *call)
+{
+	// below the pool the offset wraps around; a slab is in a mapped chunk
+	if ((size_t) ((char *) ptr - (char *) pool->start) >= ((size_t) pool->maxchunks << pool->lgsize)) {
+		harden_fail(call, ptr, "pointer outside the pool");
+	}
+	return slab_of(pool, ptr);
+}
+
+
+/**
+ * harden_check() of ptr in slab s, which is on the path of every small free
+ * and so reads no more than the slab's header, the slot's stamp, and the
+ * slot's guard if the request left room for one.
+ */
+static inline __attribute__((always_inline)) size_t harden_check_slot(struct slab *s, void *ptr, const char *call, int freeing)
+{
+	size_t slot = (char *) ptr - (char *) s - s->offset, i = slot_index(s, slot), size;
+	size_t slot_size = slab_sizes[s->cls];
+	uint64_t mask, word;
+	uint16_t *stamp;
+	char *g;
+
+	// below the first slot the offset wraps around, far above any i * size
+	if (slot != i * slot_size || i >= s->nslots) {
+		harden_fail(call, ptr, "not the start of a slot");
+	}
+	stamp = slot_stamp(s, i);
+	size = (uint16_t) (*stamp ^ harden_cookie(ptr));
+	if (size > slot_size) {
+		harden_fail(call, ptr, size == SLOT_FREED ? "double free" : "stamp overwritten by an underflow of the first slot");
+	}
+	g = slot_guard(slot_size, ptr, size, &mask);
+	if (mask != 0 && (memcpy(&word, g, sizeof(word)), ((word ^ GUARD_WORD) & mask) != 0)) {
+		harden_fail(call, ptr, "guard bytes overwritten by an overflow");
+	}
+	if (freeing) {
+		*stamp = (uint16_t) (SLOT_FREED ^ harden_cookie(ptr));
+	}
+	return size;
+}
+
+
+/**
+ * harden_check() of ptr, not in a slab. Kept out of line, off the path of small frees.
+ */
+static size_t __attribute__((noinline)) harden_check_block(struct buddy_arena *pool, void *ptr, const char *call, int freeing)
+{
+	size_t offset = (char *) ptr - (char *) pool->start, usable;
+	struct block_header *L, h;
+	uint64_t size, guard, *t = NULL;
+
+	if (!(__atomic_load_n(&pool->chunkmap, __ATOMIC_RELAXED) & (UINT64_C(1) << (offset >> pool->lgsize)))) {
+		harden_fail(call, ptr, "pointer outside the pool");
+	}
+	if (((uintptr_t) ptr & (sizeof(uint64_t) - 1)) != 0) {
+		harden_fail(call, ptr, "misaligned pointer");
+	}
+
+	L = (struct block_header *) ((char *) ptr - header_size(pool));
+	if (header_size(pool) != 0 && L->tag == ALIGNED) {
+		if (L->kval < MIN_KVAL || L->kval > pool->lgsize) {
+			harden_fail(call, ptr, "corrupted header");
+		}
+		L = block_of(pool, ptr);
+	}
+	h.state = get_state(pool, L);
+	if (h.tag == FREE) {
+		harden_fail(call, ptr, "double free");
+	}
+	if (h.tag != RESERVED || h.kval < MIN_KVAL || h.kval > pool->lgsize
+		|| (((char *) L - (char *) pool->start) & ((UINT64_C(1) << h.kval) - 1)) != 0) {
+		harden_fail(call, ptr, "not an allocated block, or its header is corrupted");
+	}
+	usable = (UINT64_C(1) << h.kval) - ((char *) ptr - (char *) L);
+
+	if (header_size(pool) == 0) {
+		t = (uint64_t *) ((char *) ptr + usable - sizeof(uint64_t));
+		size = *t ^ harden_cookie(ptr);
+	} else {
+		size = (uintptr_t) L->next ^ harden_cookie(ptr);
+	}
+	if (size == FREED_MARK) {
+		harden_fail(call, ptr, "double free");
+	}
+	if (usable < harden_pad(pool) || size > usable - harden_pad(pool)) {
+		// a cached block's next links it to the next one, which reads as garbage too
+		harden_fail(call, ptr, t != NULL ? "trailer overwritten by an overflow"
+			: "double free, or header overwritten by an underflow or an overflow of the block below");
+	}
+	memcpy(&guard, (char *) ptr + size, sizeof(guard));
+	if (guard != GUARD_WORD) {
+		harden_fail(call, ptr, "guard bytes overwritten by an overflow");
+	}
+
+	if (freeing && t != NULL) {
+		*t = FREED_MARK ^ harden_cookie(ptr);
+	} else if (freeing) {
+		L->next = (struct block_header *) (uintptr_t) (FREED_MARK ^ harden_cookie(ptr));
+	}
+	return size;
+}
+
+
+/**
+ * Checks ptr as passed to call and returns the size that was requested for it.
+ * If freeing, stamps it freed once it passed. Aborts unless ptr is memory of
+ * pool in use.
+ */
+static size_t harden_check(struct buddy_arena *pool, void *ptr, const char *call, int freeing)
+{
+	struct slab *s = harden_slab_of(pool, ptr, call);
+
+	if (s != NULL) {
+		return harden_check_slot(s, ptr, call, freeing);
+	}
+	return harden_check_block(pool, ptr, call, freeing);
+}
+
+
+/**
+ * harden_check() for a ptr about to be freed, which then marks it freed.
+ * Returns slab_of(pool, ptr).
+ */
+static inline __attribute__((always_inline)) struct slab *harden_free(struct buddy_arena *pool, void *ptr, const char *call)
+{
+	struct slab *s = harden_slab_of(pool, ptr, call);
+
+	if (s != NULL) {
+		harden_check_slot(s, ptr, call, TRUE);
+	} else {
+		harden_check_block(pool, ptr, call, TRUE);
+	}
+	return s;
+}
+
+#else
+
+#define harden_pad(pool) 0
+#define harden_alloc(pool, ptr, size) (ptr)
+#define harden_alloc_slot(ptr, size) (ptr)
+#define harden_stamp(pool, ptr, size, resized) (ptr)
+
+#endif /* BUDDY_HARDENED */
+
+
+/**
+ * Reserves a block of order kval, from the calling thread's cache if it has one
+ * for the order. Returns NULL with errno set to ENOMEM if none is left.
+ */
+static struct block_header *block_alloc(struct buddy_arena *pool, unsigned short int kval)
+{
+	struct block_header *L;
+
+	if(kval > pool->lgsize) {
+		//error
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// fast path: pop a block from this thread's cache without taking any lock
+	if (uses_tcache(pool, kval)) {
+		struct tcache *tc = tcache_get();
+
+		if (tc->head[kval] == NULL) {
+			tcache_refill(tc, kval);
+		}
+		L = tc->head[kval];
+		if (L != NULL) {
+			tc->head[kval] = L->next;
+			tc->count[kval]--;
+			return L;
+		}
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	L = reserve(pool, kval);
+
+	if (L == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return L;
+}
+
+
+/**
+ * The counters the calling thread adds to for pool: its cache's if the pool
+ * has thread caches, the pool's stripe for the thread if it is otherwise
+ * BUDDY_THREADSAFE, and the pool's only set if not.
+ */
+static struct counters *pool_counters(struct buddy_arena *pool)
+{
+	if (has_tcache(pool)) {
+		return &tcache_get()->counters;
+	}
+	if (!(pool->flags & BUDDY_THREADSAFE)) {
+		return &pool->counters[0].c;
+	}
+	if (counter_stripe == 0) {
+		counter_stripe = __atomic_add_fetch(&counter_stripes, 1, __ATOMIC_RELAXED);
+	}
+	return &pool->counters[counter_stripe % COUNTER_STRIPES].c;
+}
+
+
+/* adds the counters at from, which their writer may be adding to, to those at to */
+static void counters_sum(struct counters *to, struct counters *from)
+{
+	to->mallocs += __atomic_load_n(&from->mallocs, __ATOMIC_RELAXED);
+	to->frees += __atomic_load_n(&from->frees, __ATOMIC_RELAXED);
+	to->requested += __atomic_load_n(&from->requested, __ATOMIC_RELAXED);
+	to->reserved += __atomic_load_n(&from->reserved, __ATOMIC_RELAXED);
+	to->splits += __atomic_load_n(&from->splits, __ATOMIC_RELAXED);
+	to->merges += __atomic_load_n(&from->merges, __ATOMIC_RELAXED);
+}
+
+
+/* adds n to the counter c of pool_counters(pool) */
+static void counter_add(struct buddy_arena *pool, uint64_t *c, uint64_t n)
+{
+	if ((pool->flags & BUDDY_THREADSAFE) && !has_tcache(pool)) {
+		__atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Counts n allocations asking for requested bytes in all and handed reserved
+ * bytes of blocks and slots.
+ */
+static void count_alloc(struct buddy_arena *pool, uint64_t n, uint64_t requested, uint64_t reserved)
+{
+	struct counters *c = pool_counters(pool);
+
+	counter_add(pool, &c->mallocs, n);
+	counter_add(pool, &c->requested, requested);
+	counter_add(pool, &c->reserved, reserved);
+}
+
+
+/**
+ * Counts n frees, like count_alloc().
+ */
+static void count_free(struct buddy_arena *pool, uint64_t n)
+{
+	counter_add(pool, &pool_counters(pool)->frees, n);
+}
+
+
+/*
+ * Heap profiler. While buddy_profile_start() is in effect, each thread counts
+ * down the bytes it asks buddy_malloc for and samples the allocation that
+ * crosses zero, then draws the next distance from an exponential distribution
+ * with a mean of profile_rate bytes, so that every byte is equally likely to be
+ * sampled. A sampled allocation gets a block of its own even if it is small
+ * enough for a slab, marked in the pool's sampledmap, so that freeing an
+ * unsampled block reads one bit away from its header. Its backtrace goes to a
+ * site shared by all samples with the same stack, and a record of ptr and size
+ * to a side table, both in memory mapped for the profiler and guarded by
+ * profile_lock, which is never held while taking another lock.
+ */
+#define PROFILE_DEFAULT_RATE (512*1024)
+#define PROFILE_DEPTH 32
+#define PROFILE_HASH 4096 /* chains in each of the two hash tables */
+#define PROFILE_MAP_SIZE (256*1024)
+
+struct profile_site {
+	struct profile_site *next; // in its hash chain
+	uint64_t hash;
+	unsigned int depth;
+	void *stack[PROFILE_DEPTH]; // return addresses, innermost first
+	uint64_t live_objs, live_bytes;   // samples not freed yet
+	uint64_t alloc_objs, alloc_bytes; // every sample taken here
+};
+
+struct profile_sample {
+	struct profile_sample *next; // in its hash chain, or on profile_spare
+	void *ptr;
+	size_t size;
+	struct profile_site *site;
+};
+
+static size_t profile_rate;      // mean bytes between samples, 0 while not sampling
+static size_t profile_last_rate; // that of the last buddy_profile_start, for dumps
+static unsigned int profile_gen; // bumped by each buddy_profile_start, so 0 until profiling first starts
+static struct profile_site *profile_sites[PROFILE_HASH];
+static struct profile_sample *profile_samples[PROFILE_HASH];
+static struct profile_sample *profile_spare;
+static char *profile_mem; // unused part of the last mapping
+static size_t profile_mem_left;
+
+static __thread struct {
+	int64_t left;     // bytes to allocate before the next sample
+	unsigned int gen; // profile_gen left was drawn for
+	uint64_t rng;
+	int busy;         // taking a backtrace, whose own allocations are not sampled
+} profile_thread __attribute__((tls_model("initial-exec")));
+
+
+/* bytes to the next sample, exponentially distributed with mean profile_rate */
+static int64_t profile_interval(void)
+{
+	uint64_t x = profile_thread.rng, v;
+	double t, log2_u;
+	unsigned int e;
+
+	// xorshift64*, seeded from the thread's own address
+	if (x == 0) {
+		x = (uint64_t) (uintptr_t) &profile_thread | 1;
+	}
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	profile_thread.rng = x;
+
+	// u = v / 2^53 in (0, 1]; log2(1 + t) for t in [0, 1) to within 2e-4, without libm
+	v = ((x * UINT64_C(2685821657736338717)) >> 11) + 1;
+	e = 63 - __builtin_clzll(v);
+	t = (double) (v - (UINT64_C(1) << e)) / (double) (UINT64_C(1) << e);
+	log2_u = (double) e - 53 + t + t * (1 - t) * (0.43807325 + t * (-0.23669342 + t * 0.08030730));
+	return (int64_t) (-log2_u * 0.69314718 * __atomic_load_n(&profile_rate, __ATOMIC_RELAXED)) + 1;
+}
+
+
+/**
+ * Called once the thread's countdown went negative: TRUE if the allocation is
+ * to be sampled. The first call after buddy_profile_start only starts the count.
+ */
+static int profile_tick(void)
+{
+	unsigned int gen = __atomic_load_n(&profile_gen, __ATOMIC_RELAXED);
+
+	if (profile_thread.busy) {
+		return FALSE;
+	}
+	if (profile_thread.gen != gen) {
+		profile_thread.gen = gen;
+		profile_thread.left = profile_interval();
+		return FALSE;
+	}
+	profile_thread.left = profile_interval();
+	return TRUE;
+}
+
+
+/* TRUE if L was sampled; until a first buddy_profile_start none can be, and the map is not read */
+static int is_sampled(struct buddy_arena *pool, struct block_header *L)
+{
+	size_t i = ((char *) L - (char *) pool->start) >> MIN_KVAL;
+
+	if (__atomic_load_n(&profile_gen, __ATOMIC_RELAXED) == 0) {
+		return FALSE;
+	}
+	return (__atomic_load_n(&pool->sampledmap[i / 64], __ATOMIC_RELAXED) & (UINT64_C(1) << (i % 64))) != 0;
+}
+
+
+/* marks or unmarks the reserved block L; blocks sharing its word of the map belong to other threads */
+static void set_sampled(struct buddy_arena *pool, struct block_header *L, int sampled)
+{
+	size_t i = ((char *) L - (char *) pool->start) >> MIN_KVAL;
+
+	if (sampled) {
+		__atomic_fetch_or(&pool->sampledmap[i / 64], UINT64_C(1) << (i % 64), __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_and(&pool->sampledmap[i / 64], ~(UINT64_C(1) << (i % 64)), __ATOMIC_RELAXED);
+	}
+}
+
+
+/* size bytes for the profiler's tables, which never go back. Caller holds profile_lock. */
+static void *profile_alloc(size_t size)
+{
+	void *p;
+
+	if (size > profile_mem_left) {
+		p = mmap(NULL, PROFILE_MAP_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			return NULL;
+		}
+		profile_mem = p;
+		profile_mem_left = PROFILE_MAP_SIZE;
+	}
+	p = profile_mem;
+	profile_mem += size;
+	profile_mem_left -= size;
+	return p;
+}
+
+
+static unsigned int profile_slot(void *ptr)
+{
+	return (unsigned int) (((uintptr_t) ptr >> MIN_KVAL) * UINT64_C(0x9e3779b97f4a7c15) >> 40) & (PROFILE_HASH - 1);
+}
+
+
+/**
+ * Records the sampled allocation of size bytes at ptr, in block L, under the
+ * stack of its caller. Not inlined, so that the frame to skip is this one.
+ */
+static void __attribute__((noinline)) profile_record(struct buddy_arena *pool, struct block_header *L, void *ptr, size_t size)
+{
+	void *stack[PROFILE_DEPTH + 1];
+	struct profile_site *site;
+	struct profile_sample *sample;
+	uint64_t hash = 14695981039346656037ULL;
+	int depth, i;
+
+	profile_thread.busy = TRUE;
+	depth = backtrace(stack, PROFILE_DEPTH + 1) - 1;
+	profile_thread.busy = FALSE;
+	if (depth < 0) {
+		depth = 0;
+	}
+	for (i = 1; i <= depth; i++) {
+		hash = (hash ^ (uintptr_t) stack[i]) * 1099511628211ULL;
+	}
+
+	pthread_mutex_lock(&profile_lock);
+	for (site = profile_sites[hash & (PROFILE_HASH - 1)]; site != NULL; site = site->next) {
+		if (site->hash == hash && site->depth == (unsigned int) depth
+			&& memcmp(site->stack, stack + 1, depth * sizeof(void *)) == 0) {
+			break;
+		}
+	}
+	if (site == NULL && (site = profile_alloc(sizeof(*site))) != NULL) {
+		site->hash = hash;
+		site->depth = depth;
+		memcpy(site->stack, stack + 1, depth * sizeof(void *));
+		site->next = profile_sites[hash & (PROFILE_HASH - 1)];
+		profile_sites[hash & (PROFILE_HASH - 1)] = site;
+	}
+	sample = profile_spare;
+	if (sample != NULL) {
+		profile_spare = sample->next;
+	} else {
+		sample = profile_alloc(sizeof(*sample));
+	}
+	if (site == NULL || sample == NULL) {
+		// out of memory for the tables: the allocation goes unsampled
+		if (sample != NULL) {
+			sample->next = profile_spare;
+			profile_spare = sample;
+		}
+		pthread_mutex_unlock(&profile_lock);
+		return;
+	}
+
+	sample->ptr = ptr;
+	sample->size = size;
+	sample->site = site;
+	sample->next = profile_samples[profile_slot(ptr)];
+	profile_samples[profile_slot(ptr)] = sample;
+	site->live_objs++;
+	site->live_bytes += size;
+	site->alloc_objs++;
+	site->alloc_bytes += size;
+	pthread_mutex_unlock(&profile_lock);
+
+	set_sampled(pool, L, TRUE);
+}
+
+
+/**
+ * Drops the record of the sampled allocation at ptr, in block L, which is
+ * being freed or resized, and unmarks L.
+ */
+static void profile_forget(struct buddy_arena *pool, struct block_header *L, void *ptr)
+{
+	struct profile_sample **prev, *sample;
+
+	set_sampled(pool, L, FALSE);
+
+	pthread_mutex_lock(&profile_lock);
+	for (prev = &profile_samples[profile_slot(ptr)]; (sample = *prev) != NULL; prev = &sample->next) {
+		if (sample->ptr == ptr) {
+			*prev = sample->next;
+			sample->site->live_objs--;
+			sample->site->live_bytes -= sample->size;
+			sample->next = profile_spare;
+			profile_spare = sample;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&profile_lock);
+}
+
+
+/**
+ * Drops the records of every sampled allocation in pool, which is going away
+ * with them, as if each were freed; a later pool mapped at the same addresses
+ * does not inherit them.
+ */
+static void profile_drop(struct buddy_arena *pool)
+{
+	struct profile_sample **prev, *sample;
+	size_t end = (size_t) pool->maxchunks << pool->lgsize;
+	int i;
+
+	pthread_mutex_lock(&profile_lock);
+	for (i = 0; i < PROFILE_HASH; i++) {
+		prev = &profile_samples[i];
+		while ((sample = *prev) != NULL) {
+			if ((size_t) ((char *) sample->ptr - (char *) pool->start) >= end) {
+				prev = &sample->next;
+				continue;
+			}
+			*prev = sample->next;
+			sample->site->live_objs--;
+			sample->site->live_bytes -= sample->size;
+			sample->next = profile_spare;
+			profile_spare = sample;
+		}
+	}
+	pthread_mutex_unlock(&profile_lock);
+}
+
+
+static void *pool_malloc(struct buddy_arena *pool, size_t size)
+{
+	// a sampled allocation takes a block, which has a bit of its own in the sampled map
+	int sampled = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED) != 0
+		&& (profile_thread.left -= size) < 0 && profile_tick();
+
+	// small requests go to a slab; a pool without room for one more still has the lists
+	if (size <= SLAB_MAX_SIZE && pool->slabmap != NULL && !sampled) {
+		unsigned int cls = slab_class_of(size);
+		void *ptr = slab_malloc(pool, cls);
+
+		if (ptr != NULL) {
+			count_alloc(pool, 1, size, slab_sizes[cls]);
+			return harden_alloc_slot(ptr, size);
+		}
+	}
+
+	size_t need = size > MAX_SIZE ? size : size + harden_pad(pool);
+
+	// first, find kval of current size.
+	unsigned short int kval = need > MAX_SIZE ? MAX_KVAL : get_kval(header_size(pool)+need);
+
+	if (kval < MIN_KVAL) {
+		kval = MIN_KVAL;
+	}
+
+	struct block_header *L = block_alloc(pool, kval);
+
+	if (L == NULL) {
+		return NULL;
+	}
+
+	count_alloc(pool, 1, size, UINT64_C(1) << kval);
+	if (sampled) {
+		profile_record(pool, L, (char *) L + header_size(pool), size);
+	}
+	return harden_alloc(pool, (char *) L + header_size(pool), size);
+}
+
+
+/**
+ * Allocates size bytes aligned to align, a power of two. Blocks are aligned to
+ * their own size, and so are slots of a power-of-two class: without headers it
+ * is enough to ask for a power of two of at least align. With headers the
+ * pointer is placed at the first multiple of align that leaves room for the
+ * block's header and for an ALIGNED one right in front of the pointer.
+ */
+static void *pool_memalign(struct buddy_arena *pool, size_t align, size_t size)
+{
+	struct block_header *L, *A;
+	unsigned short int kval;
+	size_t offset, need;
+
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (align <= sizeof(void *)) {
+		return pool_malloc(pool, size);
+	}
+	if (size > MAX_SIZE || align > MAX_SIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	need = size + harden_pad(pool);
+
+	// a slot needs no room for a guard, a block does
+	kval = get_kval(size < align ? align : size);
+	if (kval < MIN_KVAL) {
+		kval = MIN_KVAL;
+	}
+	if ((UINT64_C(1) << kval) <= SLAB_MAX_SIZE && pool->slabmap != NULL) {
+		void *ptr = slab_malloc(pool, slab_class_of(UINT64_C(1) << kval));
+
+		if (ptr != NULL) {
+			count_alloc(pool, 1, size, UINT64_C(1) << kval);
+			return harden_alloc(pool, ptr, size);
+		}
+	}
+
+	kval = get_kval(need < align ? align : need);
+	if (kval < MIN_KVAL) {
+		kval = MIN_KVAL;
+	}
+
+	if (header_size(pool) == 0) {
+		L = block_alloc(pool, kval);
+		if (L != NULL) {
+			count_alloc(pool, 1, size, UINT64_C(1) << kval);
+		}
+		return harden_alloc(pool, L, size);
+	}
+
+	// the pointer must stay inside its block even for size 0, or free would not find the block
+	offset = (2 * sizeof(struct block_header) + align - 1) & ~(align - 1);
+	kval = get_kval(offset + (need != 0 ? need : 1));
+	L = block_alloc(pool, kval);
+	if (L == NULL) {
+		return NULL;
+	}
+
+	count_alloc(pool, 1, size, UINT64_C(1) << kval);
+	A = (struct block_header *) ((char *) L + offset) - 1;
+	A->tag = ALIGNED;
+	A->kval = kval;
+	return harden_alloc(pool, A + 1, size);
+}
+
+
+static void pool_free(struct buddy_arena *pool, void *ptr);
+
+static void *pool_calloc(struct buddy_arena *pool, size_t nmemb, size_t size) 
+{	
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// get address from malloc
+	void *addr = pool_malloc(pool, size * nmemb);
+	if (addr == NULL) {
+		return NULL;
+	}
+
+	// a block known to be zero only needs what overlapped its free header cleared
+	if (slab_of(pool, addr) == NULL) {
+		struct block_header *L = (struct block_header *) ((char *) addr - header_size(pool));
+
+		if (L->flags & BLOCK_ZERO) {
+			if (header_size(pool) == 0) {
+				memset(addr, 0, nmemb * size < sizeof(struct block_header) ? nmemb * size : sizeof(struct block_header));
+			}
+			return addr;
+		}
+	}
+
+	// set memory to zeros using memset
+	memset(addr, 0, (nmemb * size));
+
+	// return addr of calloc
+	return addr;
+}
+
+static void shrink_in_place(struct buddy_arena *pool, struct block_header *L, unsigned short int k, unsigned short int kval);
+static int grow_in_place(struct buddy_arena *pool, struct block_header *L, unsigned short int k, unsigned short int kval);
+
+static void *pool_realloc(struct buddy_arena *pool, void *ptr, size_t size) 
+{
+	if(ptr==NULL && size==0) {
+		errno = ENOMEM;
+		return NULL; // return errno???
+	}
+
+    //if size==0, equivalent to buddy_free(ptr)
+    if (size == 0) {
+        pool_free(pool, ptr);
+        return NULL;
+    }
+
+    // ptr==Null, equivalent to malloc(size)
+	if (ptr == NULL) {
+        return pool_malloc(pool, size);
+    }
+
+
+#ifdef BUDDY_HARDENED
+    size_t old = harden_check(pool, ptr, "buddy_realloc", FALSE);
+#else
+    size_t old = usable_size(pool, ptr);
+#endif
+    size_t need = size > MAX_SIZE ? size : size + harden_pad(pool);
+    struct slab *s = slab_of(pool, ptr);
+
+    // a slot stays if the new size maps to its class
+    if (s != NULL && size <= SLAB_MAX_SIZE && slab_class_of(size) == s->cls) {
+        return harden_stamp(pool, ptr, size, TRUE);
+    }
+
+    // a block shrinks by freeing its upper halves and grows by absorbing free buddies above it
+    if (s == NULL) {
+        struct block_header *L = block_of(pool, ptr);
+        size_t offset = (char *) ptr - (char *) L;
+        unsigned short int k = block_kval(pool, L);
+
+        // a resized block is no longer the sample taken
+        if (is_sampled(pool, L)) {
+            profile_forget(pool, L, ptr);
+        }
+
+        // get kval from block pointed to by ptr:
+        unsigned short int kval = need > MAX_SIZE ? MAX_KVAL : get_kval(need + offset);
+        if (kval < MIN_KVAL) {
+            kval = MIN_KVAL;
+        }
+
+        if (kval <= k) {
+            shrink_in_place(pool, L, k, kval);
+        } else if (kval > pool->lgsize || !grow_in_place(pool, L, k, kval)) {
+            kval = 0;
+        }
+
+        if (kval != 0) {
+            // an aligned pointer's header follows its block's order
+            if (offset != header_size(pool)) {
+                ((struct block_header *) ptr - 1)->kval = kval;
+            }
+            return harden_stamp(pool, ptr, size, TRUE);
+        }
+    }
+
+    // malloc necessary size, memcpy addr, free ptr:
+    void *addr = pool_malloc(pool, size);
+    if (addr == NULL) {
+        return NULL;
+    }
+    memcpy(addr, ptr, size < old ? size : old);
+    pool_free(pool, ptr);
+
+    return addr;
+}
+
+/**
+ * Finds the buddy of order k of current block header L.
+ * */
+static struct block_header* find_buddy(struct block_header * L, unsigned short int k) {
+	
+	uint_least64_t mask = UINT64_C(1) << k;
+
+	// pools are aligned to their own size, so flipping the kbit of the address finds the buddy:
+	struct block_header* buddy_b = (struct block_header *) (((uint_least64_t) L) ^ mask);
+
+	return buddy_b;
+}
+
+
+/**
+ * Algorithm S (buddy system liberation): returns the reserved block L of order
+ * kval to the shared lists, combining it with its buddy for as long as the buddy
+ * is free. The caller knows the order, so L itself is only written to.
+ *
+ * A free block of order purgekval or more keeps only its first page (the one
+ * holding its header) resident. The block is purged before it goes on a list,
+ * while no other thread can reach it. Merging two such blocks then only leaves
+ * the upper half's first page to purge.
+ *
+ * A purged block is known to be zero once the rest of its first page is cleared,
+ * which is skipped for huge pages. Two merged zero blocks stay zero, as the upper
+ * one's header goes with the purge of its first page.
+ */
+static void coalesce(struct buddy_arena *pool, struct block_header *L, unsigned short int kval)
+{
+	/* Follow from the Art of Computer programming p. 443-444 */
+	// 1. [is buddy available?] set P = buddy_k(L) if k=m or tag(P)=0,1 and KVAL(P) != k, SKIP TO STEP 3
+	size_t page = UINT64_C(1) << pool->pagekval;
+	int purged = FALSE;
+	unsigned int flags = 0;
+
+	//  while (1. buddy is NOT available): 2. combine with buddy
+	while(TRUE) {
+
+		struct block_header *buddy = find_buddy(L, kval); // finds the buddy of L (current block from *ptr)
+
+		if (kval >= pool->purgekval && !purged) {
+			pool_purge((char *) L + page, (UINT64_C(1) << kval) - page);
+			purged = TRUE;
+			if (pool->pagekval < PURGE_MIN_KVAL) {
+				memset(L + 1, 0, page - sizeof(struct block_header));
+				flags = BLOCK_ZERO;
+			}
+		}
+
+		// a whole free chunk of a growable pool goes back to the OS
+		if (kval == pool->lgsize && pool_shrink(pool, L)) {
+			break;
+		}
+
+		order_lock(pool, kval);
+		if(kval == pool->lgsize || !is_free_at(pool, buddy, kval)){
+			//3. [put on list]
+			avail_push(pool, L, kval, flags);
+			order_unlock(pool, kval);
+			break;
+		}
+
+		avail_unlink(pool, buddy, kval);
+		order_unlock(pool, kval);
+		count_merges(pool, 1);
+
+		kval++;
+
+		// flags is only set once purged; purging the upper half's first page clears its header
+		flags &= buddy->flags;
+		if (purged) {
+			pool_purge(buddy < L ? (void *) L : (void *) buddy, page);
+		}
+
+		if(buddy < L) {
+			L = buddy;
+		}
+
+		set_state(pool, L, RESERVED, kval);
+	}
+}
+
+
+/**
+ * Coalesces AVAIL[k] of a BUDDY_LAZY pool: takes every block off the list and
+ * runs Algorithm S on each. A block whose buddy is further down the list goes
+ * back on the list first and is then combined with the buddy. Returns FALSE if
+ * the list holds no unmerged block.
+ */
+static int lazy_drain(struct buddy_arena *pool, unsigned short int k)
+{
+	struct block_header *head = &pool->avail[k];
+	struct block_header *L, *next;
+
+	order_lock(pool, k);
+	if (pool->locks[k].lazy == 0) {
+		order_unlock(pool, k);
+		return FALSE;
+	}
+	L = head->next;
+	for (next = L; next != head; next = next->next) {
+		next->flags &= ~BLOCK_LAZY;
+		set_state(pool, next, RESERVED, k);
+	}
+	head->prev->next = NULL;
+	head->next = head->prev = head;
+	pool->locks[k].lazy = 0;
+	__atomic_store_n(&pool->locks[k].nfree, 0, __ATOMIC_RELAXED);
+	availmap_clear(pool, k);
+	order_unlock(pool, k);
+
+	for (; L != NULL; L = next) {
+		next = L->next;
+		coalesce(pool, L, k);
+	}
+	return TRUE;
+}
+
+
+/**
+ * Coalesces the lists of a BUDDY_LAZY pool below order kval, from the smallest
+ * up so that merged blocks can merge further, once no block of order kval or
+ * more is left. Returns TRUE if there was anything to coalesce.
+ */
+static int lazy_coalesce(struct buddy_arena *pool, unsigned short int kval)
+{
+	uint64_t lists;
+	int drained = FALSE;
+
+	if (!(pool->flags & BUDDY_LAZY)) {
+		return FALSE;
+	}
+	lists = __atomic_load_n(&pool->availmap, __ATOMIC_RELAXED) & ((UINT64_C(1) << kval) - 1);
+	while (lists != 0) {
+		drained |= lazy_drain(pool, __builtin_ctzll(lists));
+		lists &= lists - 1;
+	}
+	return drained;
+}
+
+
+/**
+ * TRUE if AVAIL[k] of a BUDDY_LAZY pool has room for one more unmerged block:
+ * it holds fewer than LAZY_LIMIT, and one more stays within LAZY_BYTES.
+ * Caller holds locks[k].
+ */
+static int lazy_room(struct buddy_arena *pool, unsigned short int k)
+{
+	return pool->locks[k].lazy < LAZY_LIMIT && ((uint64_t) pool->locks[k].lazy + 1) << k <= LAZY_BYTES;
+}
+
+
+/**
+ * FALSE if the reserved block L of order kval, in a chunk of a BUDDY_GROWABLE
+ * pool that may go back to the OS, is better merged at once than freed lazily:
+ * each buddy on the way up is free, so that merging frees the whole chunk, or
+ * one is free but split into blocks not merged yet, which could keep the chunk
+ * mapped for good; every lazy list is coalesced first then. The buddies are
+ * read without their locks, which only makes this a guess; coalesce() decides.
+ */
+static int lazy_keeps_chunk(struct buddy_arena *pool, struct block_header *L, unsigned short int kval)
+{
+	struct block_header h, *buddy;
+
+	if (!(pool->flags & BUDDY_GROWABLE) || ((char *) L - (char *) pool->start) >> pool->lgsize == 0) {
+		return TRUE;
+	}
+	for (; kval < pool->lgsize; kval++) {
+		buddy = find_buddy(L, kval);
+		h.state = get_state(pool, buddy);
+		if (h.tag != FREE) {
+			return TRUE;
+		}
+		if (h.kval != kval) {
+			lazy_coalesce(pool, pool->lgsize);
+			return FALSE;
+		}
+		if (buddy < L) {
+			L = buddy;
+		}
+	}
+	return FALSE;
+}
+
+
+/**
+ * Frees the reserved block L of order kval. While the pool's worker thread
+ * runs, L only goes on the pool's freed stack for the worker to merge. A
+ * BUDDY_LAZY pool puts a block below purgekval on its list as it is, so that
+ * the next request of its size does not have to split a larger block again,
+ * until the list has no room for it, see lazy_room; that list is then
+ * coalesced. Otherwise, or if lazy_keeps_chunk() says so, L is combined with
+ * its buddies at once.
+ */
+static void release(struct buddy_arena *pool, struct block_header *L, unsigned short int kval)
+{
+	// with a worker running, merging is its job
+	if ((pool->flags & BUDDY_THREADSAFE) && __atomic_load_n(&pool->background, __ATOMIC_RELAXED)) {
+		struct block_header *head = __atomic_load_n(&pool->freed, __ATOMIC_RELAXED);
+
+		do {
+			L->next = head;
+		} while (!__atomic_compare_exchange_n(&pool->freed, &head, L, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return;
+	}
+
+	if ((pool->flags & BUDDY_LAZY) && kval < pool->purgekval && kval < pool->lgsize
+		&& (UINT64_C(1) << kval) <= LAZY_BYTES && lazy_keeps_chunk(pool, L, kval)) {
+		order_lock(pool, kval);
+		if (lazy_room(pool, kval)) {
+			pool->locks[kval].lazy++;
+			avail_push(pool, L, kval, BLOCK_LAZY);
+			order_unlock(pool, kval);
+			return;
+		}
+		order_unlock(pool, kval);
+		lazy_drain(pool, kval);
+	}
+
+	coalesce(pool, L, kval);
+}
+
+
+/**
+ * Takes the most recently freed block off the pool's freed stack, or returns
+ * NULL. Caller holds worker_lock, so it is the only one taking blocks off and
+ * the next link of the top block cannot change under it.
+ */
+static struct block_header *worker_pop(struct buddy_arena *pool)
+{
+	struct block_header *L = __atomic_load_n(&pool->freed, __ATOMIC_ACQUIRE);
+
+	while (L != NULL && !__atomic_compare_exchange_n(&pool->freed, &L, L->next, TRUE,
+		__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		;
+	}
+	return L;
+}
+
+
+/**
+ * Merges every block on the pool's freed stack on the calling thread, for a
+ * request that finds no block large enough while they wait for the worker.
+ * Returns FALSE if there was none.
+ */
+static int worker_drain(struct buddy_arena *pool)
+{
+	struct block_header *L;
+	int drained = FALSE;
+
+	if (__atomic_load_n(&pool->freed, __ATOMIC_RELAXED) == NULL) {
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&pool->worker_lock);
+	while ((L = worker_pop(pool)) != NULL) {
+		coalesce(pool, L, block_kval(pool, L));
+		drained = TRUE;
+	}
+	pthread_mutex_unlock(&pool->worker_lock);
+
+	return drained;
+}
+
+
 /**
- *  Gets the Log2 (kval) of given raw size.
- * 
- * */ 
-static unsigned short int get_kval(size_t size) {
-	//TODO: limit kval min?
-	size_t kval = 1;
-	size_t curr = 1;
-	while (curr<size) {
-		curr <<= 1;
-		kval++;
+ * The worker thread: every worker_interval ms, merges up to worker_budget of
+ * the blocks freed since, purging those that grow large enough on the way.
+ * Wakes early only to stop.
+ */
+static void *worker_main(void *arg)
+{
+	struct buddy_arena *pool = arg;
+	struct block_header *L;
+	struct timespec ts;
+	size_t n;
+
+	pthread_mutex_lock(&pool->worker_lock);
+	while (pool->background) {
+		for (n = 0; (pool->worker_budget == 0 || n < pool->worker_budget) && (L = worker_pop(pool)) != NULL; n++) {
+			coalesce(pool, L, block_kval(pool, L));
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += pool->worker_interval / 1000;
+		ts.tv_nsec += (long) (pool->worker_interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pool->worker_wake, &pool->worker_lock, &ts);
+	}
+	pthread_mutex_unlock(&pool->worker_lock);
+
+	return NULL;
+}
+
+
+/**
+ * Starts the worker thread of a BUDDY_THREADSAFE pool, or changes its budget
+ * and interval if it runs already. Returns FALSE with errno set otherwise.
+ */
+static int worker_start(struct buddy_arena *pool, size_t budget, unsigned int interval_ms)
+{
+	int err;
+
+	if (!(pool->flags & BUDDY_THREADSAFE)) {
+		errno = EINVAL;
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&pool->worker_lock);
+	pool->worker_budget = budget;
+	pool->worker_interval = interval_ms;
+	if (!pool->background) {
+		__atomic_store_n(&pool->background, TRUE, __ATOMIC_RELAXED);
+		err = pthread_create(&pool->worker, NULL, worker_main, pool);
+		if (err != 0) {
+			__atomic_store_n(&pool->background, FALSE, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&pool->worker_lock);
+			errno = err;
+			return FALSE;
+		}
+	}
+	pthread_mutex_unlock(&pool->worker_lock);
+
+	return TRUE;
+}
+
+
+/**
+ * Stops the worker thread, if the pool has one running, and merges what it left.
+ */
+static void worker_stop(struct buddy_arena *pool)
+{
+	if (!(pool->flags & BUDDY_THREADSAFE)) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->worker_lock);
+	if (!pool->background) {
+		pthread_mutex_unlock(&pool->worker_lock);
+		return;
+	}
+	__atomic_store_n(&pool->background, FALSE, __ATOMIC_RELAXED);
+	pthread_cond_signal(&pool->worker_wake);
+	pthread_mutex_unlock(&pool->worker_lock);
+
+	pthread_join(pool->worker, NULL);
+	worker_drain(pool);
+}
+
+
+/**
+ * Shrinks the reserved block L from order k to kval by splitting off its upper
+ * halves, as in step R4, and releasing each of them.
+ */
+static void shrink_in_place(struct buddy_arena *pool, struct block_header *L, unsigned short int k, unsigned short int kval)
+{
+	set_state(pool, L, RESERVED, kval);
+	if (k > kval) {
+		count_splits(pool, k - kval);
+	}
+	while (k > kval) {
+		struct block_header *P;
+
+		k--;
+		P = (struct block_header *) (((uint_least64_t) L) + (UINT64_C(1) << k));
+		set_state(pool, P, RESERVED, k);
+		release(pool, P, k);
+	}
+}
+
+
+/**
+ * Grows the reserved block L from order k to kval by taking its buddies of
+ * orders k to kval-1 off the lists, which is possible only if L is the lower
+ * buddy at each of these orders and every upper buddy is free. Buddies taken
+ * before one turns out to be reserved are released again. Returns FALSE then.
+ */
+static int grow_in_place(struct buddy_arena *pool, struct block_header *L, unsigned short int k, unsigned short int kval)
+{
+	unsigned short int j;
+
+	if (((uint_least64_t) L) & ((UINT64_C(1) << kval) - 1)) {
+		return FALSE;
+	}
+
+	for (j = k; j < kval; j++) {
+		struct block_header *buddy = find_buddy(L, j);
+
+		order_lock(pool, j);
+		if (!is_free_at(pool, buddy, j)) {
+			order_unlock(pool, j);
+			break;
+		}
+		avail_unlink(pool, buddy, j);
+		order_unlock(pool, j);
+	}
+
+	if (j < kval) {
+		// L keeps order k; the buddies of orders k..j-1 go back
+		while (j-- > k) {
+			coalesce(pool, find_buddy(L, j), j);
+		}
+		return FALSE;
+	}
+
+	set_state(pool, L, RESERVED, kval);
+	count_merges(pool, kval - k);
+	return TRUE;
+}
+
+
+/**
+ * Returns the n blocks at the top of the thread's order kval cache to the shared lists.
+ */
+static void tcache_flush(struct tcache *tc, unsigned short int kval, unsigned int n)
+{
+	while (n-- > 0 && tc->head[kval] != NULL) {
+		struct block_header *L = tc->head[kval];
+		tc->head[kval] = L->next;
+		tc->count[kval]--;
+		release(&mempool, L, kval);
+	}
+}
+
+
+/**
+ * Hands every block the calling thread caches from pool back to the lists, for
+ * a request that finds no block large enough before the pool grows or fails.
+ * The slots stay: a new slab is reserved under its class lock, which returning
+ * them could need. Returns FALSE if the thread cached no block.
+ */
+static int tcache_drain(struct buddy_arena *pool)
+{
+	struct tcache *tc;
+	int k, drained = FALSE;
+
+	if (!has_tcache(pool)) {
+		return FALSE;
+	}
+	tc = tcache_get();
+	for (k = 0; k <= TCACHE_MAX_KVAL; k++) {
+		drained |= tc->count[k] != 0;
+		tcache_flush(tc, k, tc->count[k]);
+	}
+	return drained;
+}
+
+
+/**
+ * Returns the n slots at the top of the thread's class cls cache to their slabs.
+ */
+static void tcache_flush_slots(struct tcache *tc, unsigned int cls, unsigned int n)
+{
+	while (n-- > 0 && tc->slot[cls] != NULL) {
+		void *ptr = tc->slot[cls];
+		tc->slot[cls] = *(void **) ptr;
+		tc->nslot[cls]--;
+		slab_free(&mempool, slab_of(&mempool, ptr), &ptr, 1);
+	}
+}
+
+
+/**
+ * Thread exit destructor: hands everything the exiting thread still caches back to the pool.
+ */
+static void tcache_destroy(void *arg)
+{
+	struct tcache *tc = arg;
+	struct tcache **prev;
+	int k;
+
+	if (tc->generation != __atomic_load_n(&pool_generation, __ATOMIC_RELAXED)) {
+		tcache_forget(tc);
+	}
+	for (k = 0; k <= TCACHE_MAX_KVAL; k++) {
+		tcache_flush(tc, k, tc->count[k]);
+	}
+	for (k = 0; k < SLAB_CLASSES; k++) {
+		tcache_flush_slots(tc, k, tc->nslot[k]);
+	}
+
+	// its counters live on in the totals of exited threads
+	pthread_mutex_lock(&tcaches_lock);
+	for (prev = &tcaches; *prev != tc; prev = &(*prev)->next_tcache) {
+		;
+	}
+	*prev = tc->next_tcache;
+	counters_sum(&tcache_exited, &tc->counters);
+	memset(&tc->counters, 0, sizeof(tc->counters));
+	pthread_mutex_unlock(&tcaches_lock);
+	tc->registered = FALSE;
+}
+
+
+/**
+ * Frees the block L of order kval, into this thread's cache if it has one for
+ * the order, flushing a batch when the cache overflows.
+ */
+static void free_block(struct buddy_arena *pool, struct block_header *L, unsigned short int kval)
+{
+	if (uses_tcache(pool, kval)) {
+		struct tcache *tc = tcache_get();
+
+		L->flags = 0;
+		L->next = tc->head[kval];
+		tc->head[kval] = L;
+		if (++tc->count[kval] > TCACHE_LIMIT) {
+			tcache_flush(tc, kval, TCACHE_BATCH);
+		}
+		return;
+	}
+
+	release(pool, L, kval);
+}
+
+
+/**
+ * Frees ptr, which is not NULL, into slab s, the thread's cache or the lists.
+ * s is slab_of(pool, ptr).
+ */
+static void free_in(struct buddy_arena *pool, struct slab *s, void *ptr)
+{
+	count_free(pool, 1);
+
+	if (s != NULL) {
+		if (has_tcache(pool)) {
+			struct tcache *tc = tcache_get();
+
+			*(void **) ptr = tc->slot[s->cls];
+			tc->slot[s->cls] = ptr;
+			if (++tc->nslot[s->cls] > TCACHE_LIMIT) {
+				tcache_flush_slots(tc, s->cls, TCACHE_BATCH);
+			}
+			return;
+		}
+		slab_free(pool, s, &ptr, 1);
+		return;
+	}
+
+	struct block_header *L = block_of(pool, ptr); // current buddy L (returned from malloc-1 addr)
+
+	if (is_sampled(pool, L)) {
+		profile_forget(pool, L, ptr);
+	}
+	free_block(pool, L, block_kval(pool, L));
+}
+
+
+/**
+ * Frees ptr, which is not NULL, into its slab, the thread's cache or the lists.
+ */
+static void free_ptr(struct buddy_arena *pool, void *ptr)
+{
+	free_in(pool, slab_of(pool, ptr), ptr);
+}
+
+
+#ifdef BUDDY_HARDENED
+
+/*
+ * The quarantine, off until buddy_quarantine() sets a limit, holds freed memory
+ * back in a ring of at most QUARANTINE_SLOTS entries and quarantine_limit bytes,
+ * oldest first out, filled with QUARANTINE_BYTE. A write through a dangling
+ * pointer meanwhile changes the fill, which is checked once the entry leaves.
+ */
+#define QUARANTINE_SLOTS 4096
+#define QUARANTINE_BYTE 0xdf
+
+static struct quarantine_entry {
+	struct buddy_arena *pool;
+	void *ptr;
+	size_t size; // bytes filled, all of the slot or block but any trailer
+} quarantine[QUARANTINE_SLOTS];
+static unsigned int quarantine_head;  // the oldest entry
+static unsigned int quarantine_count;
+static size_t quarantine_bytes;
+
+
+/**
+ * Takes the oldest entry off the quarantine, checks its fill and frees it.
+ * Caller holds quarantine_lock.
+ */
+static void quarantine_evict(void)
+{
+	struct quarantine_entry *e = &quarantine[quarantine_head];
+	size_t i;
+
+	for (i = 0; i < e->size; i += sizeof(uint64_t)) {
+		if (*(uint64_t *) ((char *) e->ptr + i) != UINT64_C(0x0101010101010101) * QUARANTINE_BYTE) {
+			harden_fail("buddy_free", e->ptr, "written to after it was freed");
+		}
+	}
+	quarantine_head = (quarantine_head + 1) % QUARANTINE_SLOTS;
+	quarantine_count--;
+	quarantine_bytes -= e->size;
+	free_ptr(e->pool, e->ptr);
+}
+
+
+/**
+ * Holds ptr, just marked freed, in the quarantine, which the caller saw on.
+ * FALSE if ptr alone is over its limit; the caller then frees ptr itself.
+ */
+static int quarantine_hold(struct buddy_arena *pool, void *ptr)
+{
+	size_t size;
+
+	size = usable_size(pool, ptr) - (has_trailer(pool, ptr) ? sizeof(uint64_t) : 0);
+
+	pthread_mutex_lock(&quarantine_lock);
+	if (size > quarantine_limit) {
+		pthread_mutex_unlock(&quarantine_lock);
+		return FALSE;
+	}
+	while (quarantine_count == QUARANTINE_SLOTS || quarantine_bytes + size > quarantine_limit) {
+		quarantine_evict();
+	}
+	memset(ptr, QUARANTINE_BYTE, size);
+	quarantine[(quarantine_head + quarantine_count) % QUARANTINE_SLOTS] = (struct quarantine_entry) { pool, ptr, size };
+	quarantine_count++;
+	quarantine_bytes += size;
+	pthread_mutex_unlock(&quarantine_lock);
+	return TRUE;
+}
+
+
+/**
+ * Forgets the entries of pool, which is going away, without freeing them.
+ */
+static void quarantine_drop(struct buddy_arena *pool)
+{
+	unsigned int i, n = 0;
+
+	pthread_mutex_lock(&quarantine_lock);
+	for (i = 0; i < quarantine_count; i++) {
+		struct quarantine_entry *e = &quarantine[(quarantine_head + i) % QUARANTINE_SLOTS];
+
+		if (e->pool == pool) {
+			quarantine_bytes -= e->size;
+		} else {
+			quarantine[(quarantine_head + n++) % QUARANTINE_SLOTS] = *e;
+		}
+	}
+	quarantine_count = n;
+	pthread_mutex_unlock(&quarantine_lock);
+}
+
+#endif /* BUDDY_HARDENED */
+
+
+static void pool_free(struct buddy_arena *pool, void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+#ifdef BUDDY_HARDENED
+	struct slab *s = harden_free(pool, ptr, "buddy_free");
+
+	if (__atomic_load_n(&quarantine_limit, __ATOMIC_RELAXED) != 0 && quarantine_hold(pool, ptr)) {
+		return;
+	}
+	free_in(pool, s, ptr);
+#else
+	free_ptr(pool, ptr);
+#endif
+}
+
+
+/**
+ * pool_free() for a ptr whose requested size the caller knows, which gives the
+ * block's order without reading its header or side table byte. Slots still go
+ * through pool_free(), as their size is in the slab header, not in the slot.
+ * With BUDDY_DEBUG the size is checked against the stored order; with
+ * BUDDY_HARDENED it must be the one requested, and the rest is pool_free().
+ */
+static void pool_free_sized(struct buddy_arena *pool, void *ptr, size_t size)
+{
+	struct block_header *L;
+	unsigned short int kval;
+
+#ifdef BUDDY_HARDENED
+	if (ptr != NULL && harden_check(pool, ptr, "buddy_free_sized", FALSE) != size) {
+		harden_fail("buddy_free_sized", ptr, "size differs from the one requested");
+	}
+	pool_free(pool, ptr);
+	return;
+#endif
+
+	// nothing on the header's cache line is read: the size gives the order, and free_block only writes L
+	if (ptr == NULL || slab_of(pool, ptr) != NULL) {
+		pool_free(pool, ptr);
+		return;
+	}
+
+	kval = size > MAX_SIZE ? MAX_KVAL : get_kval(header_size(pool) + size);
+	if (kval < MIN_KVAL) {
+		kval = MIN_KVAL;
+	}
+	L = (struct block_header *) ((char *) ptr - header_size(pool));
+	count_free(pool, 1);
+
+#ifdef BUDDY_DEBUG
+	if (header_size(pool) != 0 && L->tag == ALIGNED) {
+		fprintf(stderr, "buddy_free_sized(%p, %zu): pointer from buddy_memalign\n", ptr, size);
+		abort();
 	}
+	if (block_kval(pool, L) != kval || (header_size(pool) != 0 && L->tag != RESERVED)) {
+		fprintf(stderr, "buddy_free_sized(%p, %zu): block of order %d, not %d\n", ptr, size,
+			block_kval(pool, L), kval);
+		abort();
+	}
+#endif
+
+	if (is_sampled(pool, L)) {
+		profile_forget(pool, L, ptr);
+	}
+	free_block(pool, L, kval);
+}
+
+
+/**
+ * Allocates n objects of size bytes into out[]. Slots come from one pass over
+ * the class's slabs; blocks from reserve_batch(), which splits one larger block
+ * into as many blocks of the order as it holds. Returns the number allocated,
+ * fewer than n with errno set to ENOMEM once the pool runs out.
+ */
+static size_t pool_malloc_batch(struct buddy_arena *pool, size_t size, size_t n, void **out)
+{
+	struct block_header *batch[TCACHE_BATCH];
+	unsigned short int kval;
+	size_t got = 0, need = size > MAX_SIZE ? size : size + harden_pad(pool);
+	unsigned int i, m;
+
+	if (size <= SLAB_MAX_SIZE && pool->slabmap != NULL) {
+		while (got < n && (m = slab_alloc(pool, slab_class_of(size), n - got > UINT_MAX ? UINT_MAX : n - got, out + got)) > 0) {
+			count_alloc(pool, m, (uint64_t) m * size, (uint64_t) m * slab_sizes[slab_class_of(size)]);
+			got += m;
+		}
+	}
+
+	kval = need > MAX_SIZE ? MAX_KVAL : get_kval(header_size(pool) + need);
+	if (kval < MIN_KVAL) {
+		kval = MIN_KVAL;
+	}
+	if (got < n && kval > pool->lgsize) {
+		errno = ENOMEM;
+		return got;
+	}
+
+	while (got < n) {
+		m = reserve_batch(pool, kval, n - got < TCACHE_BATCH ? n - got : TCACHE_BATCH, batch);
+		if (m == 0) {
+			errno = ENOMEM;
+			break;
+		}
+		for (i = 0; i < m; i++) {
+			out[got++] = (char *) batch[i] + header_size(pool);
+		}
+		count_alloc(pool, m, (uint64_t) m * size, (uint64_t) m << kval);
+	}
+
+#ifdef BUDDY_HARDENED
+	for (n = got; n > 0; n--) {
+		harden_alloc(pool, out[n - 1], size);
+	}
+#endif
+	return got;
+}
+
+
+/**
+ * Frees the n objects ptr[] in one pass. Consecutive slots of the same slab go
+ * back under one hold of the class lock. A run of blocks in ascending address
+ * order is kept on a stack, where each is combined with the block below it for
+ * as long as that is its buddy, before any list is locked; only what is left
+ * when the run ends goes through Algorithm S. A batch sorted by address, as
+ * pool_malloc_batch() mostly hands it out, thus coalesces within itself without
+ * the lists, and is not sorted here: sorting cost more than it saved.
+ */
+static void pool_free_batch(struct buddy_arena *pool, void **ptr, size_t n)
+{
+	struct block_header *stack[2 * MAX_KVAL];
+	unsigned short int kvals[2 * MAX_KVAL];
+	size_t i, j;
+	int top = -1;
+
+#ifdef BUDDY_HARDENED
+	for (i = 0; i < n; i++) {
+		if (ptr[i] != NULL) {
+			harden_free(pool, ptr[i], "buddy_free_batch");
+		}
+	}
+	if (__atomic_load_n(&quarantine_limit, __ATOMIC_RELAXED) != 0) {
+		for (i = 0; i < n; i++) {
+			if (ptr[i] != NULL && !quarantine_hold(pool, ptr[i])) {
+				free_ptr(pool, ptr[i]);
+			}
+		}
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; i = j) {
+		struct slab *s;
+		struct block_header *L;
+		unsigned short int kval;
+
+		if (ptr[i] == NULL) {
+			j = i + 1;
+			continue;
+		}
+
+		if ((s = slab_of(pool, ptr[i])) != NULL) {
+			for (j = i + 1; j < n && j - i < UINT_MAX && ptr[j] != NULL && slab_of(pool, ptr[j]) == s; j++) {
+				;
+			}
+			slab_free(pool, s, ptr + i, j - i);
+			count_free(pool, j - i);
+			continue;
+		}
+		j = i + 1;
+		count_free(pool, 1);
+
+		L = block_of(pool, ptr[i]);
+		kval = block_kval(pool, L);
+		if (is_sampled(pool, L)) {
+			profile_forget(pool, L, ptr[i]);
+		}
+
+		// a block that does not follow the top of the stack in memory ends its run,
+		// and so does a full stack, which only a run across chunks can fill
+		while (top >= 0 && ((char *) L != (char *) stack[top] + (UINT64_C(1) << kvals[top]) || top == 2 * MAX_KVAL - 1)) {
+			release(pool, stack[top], kvals[top]);
+			top--;
+		}
+
+		// combine with the top of the stack for as long as it is the lower buddy
+		while (top >= 0 && kvals[top] == kval && kval < pool->lgsize && find_buddy(L, kval) == stack[top]) {
+			L = stack[top--];
+			kval++;
+			set_state(pool, L, RESERVED, kval);
+			count_merges(pool, 1);
+		}
+		stack[++top] = L;
+		kvals[top] = kval;
+	}
+
+	while (top >= 0) {
+		release(pool, stack[top], kvals[top]);
+		top--;
+	}
+}
+
+
+/* the process-wide functions use the default arena, initialized on first use */
+
+void *buddy_malloc(size_t size)
+{
+	void *ptr;
+	CALL_BEGIN(probe);
+
+	// check if budddy init has already been called:
+	if (initialized==FALSE) {
+		if(buddy_init(0) != TRUE) {
+			errno=ENOMEM;
+			return NULL;
+		}
+		initialized = TRUE;
+	}
+
+	ptr = pool_malloc(&mempool, size);
+	MALLOC_END(probe, ptr, size);
+	return ptr;
+}
+
 
-	return kval-1;
+void *buddy_calloc(size_t nmemb, size_t size) 
+{
+	if (initialized==FALSE && buddy_init(0) != TRUE) {
+		errno=ENOMEM;
+		return NULL;
+	}
+	return pool_calloc(&mempool, nmemb, size);
 }
 
 
-/* the header for an available block */
-struct block_header {
-	short tag;
-	short kval;
-	struct block_header *next;
-	struct block_header *prev;
-};
+void *buddy_realloc(void *ptr, size_t size) 
+{
+	if (initialized==FALSE && buddy_init(0) != TRUE) {
+		errno=ENOMEM;
+		return NULL;
+	}
+	return pool_realloc(&mempool, ptr, size);
+}
 
-const int RESERVED = 0;
-const int FREE = 1;
-const int UNUSED = -1; /* useful for header nodes */
 
+void buddy_free(void *ptr) 
+{
+	CALL_BEGIN(probe);
 
-/* supports memory upto 2^(MAX_KVAL-1) (or 64 GB) in size */
-#define  MAX_KVAL  37
-#define MAX_SIZE ((size_t) 1 << (MAX_KVAL-1))
+	if(!initialized) {
+		return;
+	}
+	pool_free(&mempool, ptr);
+	FREE_END(probe, ptr);
+}
 
 
-/* default memory allocation is 512MB */
-const size_t DEFAULT_MAX_MEM_SIZE = 512*1024*1024;
+void buddy_free_sized(void *ptr, size_t size)
+{
+	CALL_BEGIN(probe);
 
+	if(!initialized) {
+		return;
+	}
+	pool_free_sized(&mempool, ptr, size);
+	FREE_END(probe, ptr);
+}
 
-/* A static structure stores the table of pointers to the lists in the buddy system.  */
-struct pool {
-	void *start; // pointer to the start of the memory pool
-	int lgsize;  // log2 of size
-	size_t size; // size of the pool, same as 2 ^ lgsize
-	/* the table of pointers to the buddy system lists */
-	struct block_header avail[MAX_KVAL];
-} pool;
 
+size_t buddy_malloc_batch(size_t size, size_t n, void **out)
+{
+	if (initialized==FALSE && buddy_init(0) != TRUE) {
+		errno=ENOMEM;
+		return 0;
+	}
+	return pool_malloc_batch(&mempool, size, n, out);
+}
 
-/* initialize structures */
 
-static struct pool mempool;
+void buddy_free_batch(void **ptrs, size_t n)
+{
+	if(!initialized) {
+		return;
+	}
+	pool_free_batch(&mempool, ptrs, n);
+}
+
 
-int buddy_init(size_t size) {
-	// check if size > max available
-	if (size > MAX_SIZE) {
+void *buddy_memalign(size_t alignment, size_t size)
+{
+	if (initialized==FALSE && buddy_init(0) != TRUE) {
 		errno=ENOMEM;
-		return errno;
+		return NULL;
 	}
+	return pool_memalign(&mempool, alignment, size);
+}
+
 
+int buddy_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
 	void *ptr;
-	// check for default initialization
-	if (size==0) {
-		ptr = (void *) sbrk(DEFAULT_MAX_MEM_SIZE);
-		mempool.size = DEFAULT_MAX_MEM_SIZE;
-	}else {
-		// round to next power of 2 (unchanged if not)
-		unsigned short int kval = get_kval(size);
-		size = (UINT64_C(1) <<kval);
-		ptr = (void *) sbrk(size);
-		mempool.size = size;
-	}
-
-	// check if sbrk failed:
-	if(ptr == (void *)-1) {
-		errno = ENOMEM;
+
+	if (alignment % sizeof(void *) != 0) {
+		return EINVAL;
+	}
+	ptr = buddy_memalign(alignment, size);
+	if (ptr == NULL) {
 		return errno;
 	}
+	*memptr = ptr;
+	return 0;
+}
 
-	mempool.start = (void *) ptr; // sets start address for memory block
 
-	// find logsize/kval of mempool (log2):	
-	unsigned short int kval = get_kval(mempool.size);
+void *buddy_aligned_alloc(size_t alignment, size_t size)
+{
+	return buddy_memalign(alignment, size);
+}
 
-	// set the rest of mempool variables and create initial block_header
-	mempool.lgsize = kval;	
-	
-	size_t i = 0;
-	// create block headers up to kval index
-	for(i = 0; i < kval; i++) {
-		mempool.avail[i].next = mempool.avail[i].prev = &mempool.avail[i]; // set next and prev pointers to self for malloc algorithm
-		mempool.avail[i].kval = i; // set kval to curr.
-		mempool.avail[i].tag = UNUSED; 
+
+int buddy_background_start(size_t budget, unsigned int interval_ms)
+{
+	if (!initialized) {
+		errno = EINVAL;
+		return FALSE;
 	}
+	return worker_start(&mempool, budget, interval_ms);
+}
 
-	// set kval index block header
-	mempool.avail[kval].next = mempool.avail[kval].prev = (struct block_header *)mempool.start;
-	mempool.avail[kval].next->tag = FREE;
-	mempool.avail[kval].next->kval = kval;
-	mempool.avail[kval].next->next = mempool.avail[kval].next->prev = &mempool.avail[kval];
 
-	initialized = TRUE;
-    return TRUE;
+void buddy_background_stop(void)
+{
+	if (initialized) {
+		worker_stop(&mempool);
+	}
 }
 
 
-void *buddy_malloc(size_t size)
+size_t buddy_usable_size(void *ptr)
 {
-	// check if budddy init has already been called:
-	if (initialized==FALSE) {
-		if(buddy_init(0) != TRUE) {
-			errno=ENOMEM;
-			return NULL;
-		}
-		initialized = TRUE;
+	if (!initialized || ptr == NULL) {
+		return 0;
 	}
+#ifdef BUDDY_HARDENED
+	return harden_check(&mempool, ptr, "buddy_usable_size", FALSE);
+#else
+	return usable_size(&mempool, ptr);
+#endif
+}
 
-	// first, find kval of current size.
-	unsigned short int kval = get_kval(sizeof(struct block_header)+size);
 
-	if(kval > mempool.lgsize) {
-		//error
-		errno = ENOMEM;
-		return NULL;
-	}
+void *buddy_arena_malloc(buddy_arena_t *arena, size_t size)
+{
+	void *ptr;
+	CALL_BEGIN(probe);
 
-	/* Now we begin following Algorithm R (Buddu system reservation) as closely as possible */
+	ptr = pool_malloc(arena, size);
+	MALLOC_END(probe, ptr, size);
+	return ptr;
+}
 
-	//1. (find block): let j be the smallest int in range k <=j<= m in which AVAILF[j] != LOC(AVAIL[j]
-	struct block_header *free_block = NULL;
-	unsigned short int j = kval;
 
-	while(j <= mempool.lgsize && (free_block == NULL)) { // smallest in range kval <= j <= mempool.lgsize
-		if(mempool.avail[j].next != &mempool.avail[j]) { // AVAILF[j] != LOC(AVAIL[j]), or, avail.next != address of avail[j]
-			free_block = mempool.avail[j].next;
-			break;
+void *buddy_arena_calloc(buddy_arena_t *arena, size_t nmemb, size_t size)
+{
+	return pool_calloc(arena, nmemb, size);
+}
+
+
+void *buddy_arena_realloc(buddy_arena_t *arena, void *ptr, size_t size)
+{
+	return pool_realloc(arena, ptr, size);
+}
+
+
+void buddy_arena_free(buddy_arena_t *arena, void *ptr)
+{
+	CALL_BEGIN(probe);
+
+	pool_free(arena, ptr);
+	FREE_END(probe, ptr);
+}
+
+
+void buddy_arena_free_sized(buddy_arena_t *arena, void *ptr, size_t size)
+{
+	CALL_BEGIN(probe);
+
+	pool_free_sized(arena, ptr, size);
+	FREE_END(probe, ptr);
+}
+
+
+size_t buddy_arena_malloc_batch(buddy_arena_t *arena, size_t size, size_t n, void **out)
+{
+	return pool_malloc_batch(arena, size, n, out);
+}
+
+
+void buddy_arena_free_batch(buddy_arena_t *arena, void **ptrs, size_t n)
+{
+	pool_free_batch(arena, ptrs, n);
+}
+
+
+void *buddy_arena_memalign(buddy_arena_t *arena, size_t alignment, size_t size)
+{
+	return pool_memalign(arena, alignment, size);
+}
+
+
+int buddy_arena_background_start(buddy_arena_t *arena, size_t budget, unsigned int interval_ms)
+{
+	return worker_start(arena, budget, interval_ms);
+}
+
+
+void buddy_arena_background_stop(buddy_arena_t *arena)
+{
+	worker_stop(arena);
+}
+
+
+size_t buddy_arena_usable_size(buddy_arena_t *arena, void *ptr)
+{
+#ifdef BUDDY_HARDENED
+	return ptr == NULL ? 0 : harden_check(arena, ptr, "buddy_arena_usable_size", FALSE);
+#else
+	return ptr == NULL ? 0 : usable_size(arena, ptr);
+#endif
+}
+
+
+/**
+ * Fills stats from the counters of pool, and for the default arena from those
+ * of every thread.
+ */
+static void pool_stats(struct buddy_arena *pool, struct buddy_stats *stats)
+{
+	struct counters c;
+	struct tcache *tc;
+	int k;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->pool_bytes = __builtin_popcountll(__atomic_load_n(&pool->chunkmap, __ATOMIC_RELAXED)) * pool->size;
+	for (k = 0; k < MAX_KVAL; k++) {
+		stats->free_blocks[k] = __atomic_load_n(&pool->locks[k].nfree, __ATOMIC_RELAXED);
+		stats->free_bytes += stats->free_blocks[k] << k;
+		if (stats->free_blocks[k] != 0) {
+			stats->largest_free = (size_t) 1 << k;
 		}
-		j++;
 	}
-
-	if(free_block == NULL) {
-		errno = ENOMEM;
-		return NULL;
+	for (k = 0; k < SLAB_CLASSES; k++) {
+		stats->slab_bytes += __atomic_load_n(&pool->slabs[k].nslabs, __ATOMIC_RELAXED) << SLAB_KVAL;
+		stats->slab_free_bytes += __atomic_load_n(&pool->slabs[k].free_slots, __ATOMIC_RELAXED) * slab_sizes[k];
 	}
 
-	j = free_block->kval;
+	memset(&c, 0, sizeof(c));
+	for (k = 0; k < COUNTER_STRIPES; k++) {
+		counters_sum(&c, &pool->counters[k].c);
+	}
+	if (pool == &mempool && (pool->flags & BUDDY_THREADSAFE)) {
+		pthread_mutex_lock(&tcaches_lock);
+		counters_sum(&c, &tcache_exited);
+		for (tc = tcaches; tc != NULL; tc = tc->next_tcache) {
+			// a cache not used since the pool was replaced still counts for the old one
+			if (__atomic_load_n(&tc->generation, __ATOMIC_ACQUIRE) != __atomic_load_n(&pool_generation, __ATOMIC_RELAXED)) {
+				continue;
+			}
+			counters_sum(&c, &tc->counters);
+		}
+		pthread_mutex_unlock(&tcaches_lock);
+	}
 
-	//2. (remove from list): set L=AVAILF[j], P=LINKF(L), AVAILF[j] = P, LINKB(P) = LOC(AVAIL[j]) and TAG(L)=0
-	
-	struct block_header *L = mempool.avail[j].next;
-	struct block_header *P = L->next;
-	mempool.avail[j].next = P;
-	P->prev = &mempool.avail[j];
-	L->tag = RESERVED;
-	L->kval = kval;
+	stats->mallocs = c.mallocs;
+	stats->frees = c.frees;
+	stats->splits = c.splits;
+	stats->merges = c.merges;
+	stats->requested_bytes = c.requested;
+	stats->reserved_bytes = c.reserved;
+	stats->internal_fragmentation = c.reserved ? 1.0 - (double) c.requested / c.reserved : 0.0;
+}
 
-	//3. Check if split is required: If j=k, terminate(we have found and reserved an available block at address L)
 
-	//4. Split: Decrement j, set P=L+2^j, Tag(P)=1, kval(P)=j, LINKF(P)=LINKB(P)=LOC(AVAIL[j]), AVAILF[j]=AVAILB[j]=P.
-	while(j!=kval) {
-		j--;
-		struct block_header *P = (struct block_header *) (((uint_least64_t) L) + (UINT64_C(1) << j));
-		P->tag = FREE;
-		P->kval = j;
-		P->next = P->prev = &mempool.avail[j];
-		mempool.avail[j].next = mempool.avail[j].prev = P;
+void buddy_stats(struct buddy_stats *stats)
+{
+	if (!initialized) {
+		memset(stats, 0, sizeof(*stats));
+		return;
 	}
+	pool_stats(&mempool, stats);
+}
+
 
-	return L+1;
+void buddy_arena_stats(buddy_arena_t *arena, struct buddy_stats *stats)
+{
+	pool_stats(arena, stats);
 }
 
 
-void *buddy_calloc(size_t nmemb, size_t size) 
-{	
-	// get address from malloc
-	void *addr = buddy_malloc(size * nmemb);
+/* buffered output of pool_dump_map and buddy_profile_dump, which must not allocate */
+struct map_writer {
+	int fd;
+	int error; // errno of the first failed write, 0 if none
+	size_t n;  // bytes in buf
+	unsigned char buf[4096];
+};
 
-	// set memory to zeros using memset
-	memset(addr, 0, (nmemb * size));
+static void map_flush(struct map_writer *w)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < w->n && w->error == 0) {
+		r = write(w->fd, w->buf + done, w->n - done);
+		if (r > 0) {
+			done += r;
+		} else if (r == 0 || errno != EINTR) {
+			w->error = r == 0 ? EIO : errno;
+		}
+	}
+	w->n = 0;
+}
 
-	// return addr of calloc
-	return addr;
+static void map_put(struct map_writer *w, unsigned char byte)
+{
+	if (w->n == sizeof(w->buf)) {
+		map_flush(w);
+	}
+	w->buf[w->n++] = byte;
 }
 
-void *buddy_realloc(void *ptr, size_t size) 
+/* little-endian, in bytes bytes */
+static void map_put_le(struct map_writer *w, uint64_t v, unsigned int bytes)
 {
-	if(ptr==NULL && size==0) {
-		errno = ENOMEM;
-		return NULL; // return errno???
+	while (bytes-- > 0) {
+		map_put(w, v & 0xff);
+		v >>= 8;
 	}
+}
 
-    //if size==0, equivalent to buddy_free(ptr)
-    if (size == 0) {
-        buddy_free(ptr);
-        return NULL;
-    }
+static void map_puts(struct map_writer *w, const char *s)
+{
+	while (*s != '\0') {
+		map_put(w, *s++);
+	}
+}
 
-    // ptr==Null, equivalent to malloc(size)
-	if (ptr == NULL) {
-        return buddy_malloc(size);
-    }
+/* LEB128: seven bits a byte, low first, the top bit set on all but the last */
+static void map_put_count(struct map_writer *w, uint64_t v)
+{
+	while (v >= 0x80) {
+		map_put(w, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	map_put(w, v);
+}
 
 
-    // get block pointed to by ptr:
-    struct block_header *block = (struct block_header *)ptr - 1;
+/**
+ * Streams the map of pool described with buddy_dump_map() to fd, walking each
+ * chunk block by block with the pool locked. The order of a slab comes from
+ * the slab map, as the slab overwrote its block's header; every other block's
+ * comes from its header or side table byte. A block whose order or alignment
+ * does not fit the pool ends the dump with EIO.
+ */
+static int pool_dump_map(struct buddy_arena *pool, int fd)
+{
+	struct map_writer w;
+	struct block_header h, *L;
+	uint64_t chunks, run = 0;
+	unsigned int i, state, last = 0;
+	char *p, *end;
+
+	w.fd = fd;
+	w.error = 0;
+	w.n = 0;
+
+	pool_lock_all(pool);
+	chunks = pool->chunkmap;
+
+	map_put(&w, 'B');
+	map_put(&w, 'M');
+	map_put(&w, 'A');
+	map_put(&w, 'P');
+	map_put(&w, BUDDY_MAP_VERSION);
+	map_put(&w, pool->lgsize);
+	map_put(&w, MIN_KVAL);
+	map_put(&w, pool->pagekval);
+	map_put_le(&w, pool->flags, 4);
+	map_put_le(&w, __builtin_popcountll(chunks), 4);
+	map_put_le(&w, (uintptr_t) pool->start, 8);
+
+	for (; chunks != 0 && w.error == 0; chunks &= chunks - 1) {
+		i = __builtin_ctzll(chunks);
+		map_put_le(&w, i, 4);
+		p = (char *) pool->start + ((size_t) i << pool->lgsize);
+		end = p + pool->size;
+		for (; p < end; p += (size_t) 1 << h.kval) {
+			L = (struct block_header *) p;
+			if (((p - (char *) pool->start) & ((1 << SLAB_KVAL) - 1)) == 0 && slab_of(pool, p) != NULL) {
+				h.kval = SLAB_KVAL;
+				state = BUDDY_MAP_SLAB;
+			} else {
+				h.state = get_state(pool, L);
+				state = h.tag != FREE ? BUDDY_MAP_RESERVED : (L->flags & BLOCK_LAZY) ? BUDDY_MAP_LAZY : BUDDY_MAP_FREE;
+			}
+			if (h.kval < MIN_KVAL || h.kval > pool->lgsize
+				|| ((p - (char *) pool->start) & (((size_t) 1 << h.kval) - 1)) != 0) {
+				w.error = EIO;
+				break;
+			}
+
+			if (run != 0 && (state << 6 | h.kval) != last) {
+				map_put(&w, last);
+				map_put_count(&w, run);
+				run = 0;
+			}
+			last = state << 6 | h.kval;
+			run++;
+		}
+		if (run != 0 && w.error == 0) {
+			map_put(&w, last);
+			map_put_count(&w, run);
+			run = 0;
+		}
+	}
 
-    // get kval from block pointed to by ptr:
-    unsigned short int kval = get_kval(size + sizeof(struct block_header));
+	map_flush(&w);
+	pool_unlock_all(pool);
 
-    // check if kval is already pointing to block-kval:
-    if (kval == block->kval) {
-        return ptr;
-    }
+	if (w.error != 0) {
+		errno = w.error;
+		return FALSE;
+	}
+	return TRUE;
+}
 
-    // malloc necessary size, memcpy addr, free ptr:
-    void *addr = buddy_malloc(size);
-    memcpy(addr, ptr, size);
-    buddy_free(ptr);
 
-    return addr;
+int buddy_dump_map(int fd)
+{
+	if (!initialized) {
+		errno = EINVAL;
+		return FALSE;
+	}
+	return pool_dump_map(&mempool, fd);
 }
 
-/**
- * Finds the buddy from current block header L.
- * */
-static struct block_header* find_buddy(struct block_header * L) {
-	
-	// unsigned short int k = L->kval;
 
-	uint_least64_t buddy_a = ((uint_least64_t) L) - ((uint_least64_t) mempool.start);
-	uint_least64_t mask = UINT64_C(1) << L->kval;
+int buddy_arena_dump_map(buddy_arena_t *arena, int fd)
+{
+	return pool_dump_map(arena, fd);
+}
+
 
-	// create pointer to buddy_b after flipping kbit and aligning with start addr:
-	struct block_header* buddy_b = (struct block_header *) ((buddy_a ^ mask) + ((uint_least64_t) mempool.start));
+int buddy_profile_start(size_t rate)
+{
+	void *stack[1];
 
-	return buddy_b;
+	if (rate == 0) {
+		rate = PROFILE_DEFAULT_RATE;
+	}
+	// the first backtrace may load the unwinder, which allocates; better here than in buddy_malloc
+	backtrace(stack, 1);
+	pthread_mutex_lock(&profile_lock);
+	profile_last_rate = rate;
+	__atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&profile_gen, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&profile_lock);
+	return TRUE;
 }
 
 
-void buddy_free(void *ptr) 
+void buddy_profile_stop(void)
 {
-	if(ptr == NULL || !initialized) {
-		return;
+	__atomic_store_n(&profile_rate, 0, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Writes the sites in the legacy heap profile format of gperftools, which
+ * pprof reads: a header with the totals and the sampling rate, a line per site
+ * with its live and total counts and its stack, then the process's mappings
+ * for symbolizing the addresses.
+ */
+int buddy_profile_dump(int fd)
+{
+	struct map_writer w;
+	struct profile_site *site;
+	uint64_t live_objs = 0, live_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+	char line[128];
+	unsigned int i, j;
+	ssize_t n;
+	int maps;
+
+	w.fd = fd;
+	w.error = 0;
+	w.n = 0;
+
+	pthread_mutex_lock(&profile_lock);
+	for (i = 0; i < PROFILE_HASH; i++) {
+		for (site = profile_sites[i]; site != NULL; site = site->next) {
+			live_objs += site->live_objs;
+			live_bytes += site->live_bytes;
+			alloc_objs += site->alloc_objs;
+			alloc_bytes += site->alloc_bytes;
+		}
+	}
+	snprintf(line, sizeof(line), "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu\n",
+		(unsigned long long) live_objs, (unsigned long long) live_bytes, (unsigned long long) alloc_objs,
+		(unsigned long long) alloc_bytes, (unsigned long long) (profile_last_rate ? profile_last_rate : PROFILE_DEFAULT_RATE));
+	map_puts(&w, line);
+	for (i = 0; i < PROFILE_HASH; i++) {
+		for (site = profile_sites[i]; site != NULL; site = site->next) {
+			snprintf(line, sizeof(line), "%llu: %llu [%llu: %llu] @",
+				(unsigned long long) site->live_objs, (unsigned long long) site->live_bytes,
+				(unsigned long long) site->alloc_objs, (unsigned long long) site->alloc_bytes);
+			map_puts(&w, line);
+			for (j = 0; j < site->depth; j++) {
+				snprintf(line, sizeof(line), " %p", site->stack[j]);
+				map_puts(&w, line);
+			}
+			map_put(&w, '\n');
+		}
+	}
+	pthread_mutex_unlock(&profile_lock);
+
+	map_puts(&w, "\nMAPPED_LIBRARIES:\n");
+	map_flush(&w);
+	maps = open("/proc/self/maps", O_RDONLY);
+	if (maps >= 0) {
+		while (w.error == 0 && (n = read(maps, w.buf, sizeof(w.buf))) != 0) {
+			if (n < 0) {
+				if (errno != EINTR) {
+					w.error = errno;
+				}
+				continue;
+			}
+			w.n = n;
+			map_flush(&w);
+		}
+		close(maps);
 	}
 
-	/* Follow from the Art of Computer programming p. 443-444 */
-	// 1. [is buddy available?] set P = buddy_k(L) if k=m or tag(P)=0,1 and KVAL(P) != k, SKIP TO STEP 3
-	struct block_header *L = (struct block_header *)ptr-1; // current buddy L (returned from malloc-1 addr)
-	unsigned short int kval = L->kval; 
+	if (w.error != 0) {
+		errno = w.error;
+		return FALSE;
+	}
+	return TRUE;
+}
 
-	//  while (1. buddy is NOT available): 2. combine with buddy
-	while(TRUE) {
 
-		struct block_header *buddy = find_buddy(L); // finds the buddy of L (current block from *ptr)
+int buddy_histograms_get(struct buddy_histograms *h)
+{
+#ifdef BUDDY_INSTRUMENT
+	hist_copy(&h->malloc_cycles, &histograms.malloc_cycles);
+	hist_copy(&h->free_cycles, &histograms.free_cycles);
+	hist_copy(&h->malloc_splits, &histograms.malloc_splits);
+	hist_copy(&h->free_merges, &histograms.free_merges);
+	return TRUE;
+#else
+	memset(h, 0, sizeof(*h));
+	errno = ENOSYS;
+	return FALSE;
+#endif
+}
 
-		if(kval == mempool.lgsize || buddy->tag == RESERVED || (buddy->tag == FREE && buddy->kval != kval)){
-			//3. [put on list]
-			L->tag = FREE;
-			buddy = mempool.avail[kval].next;	
-			L->next = buddy;
-			buddy->prev = L;
-			L->kval = kval;
-			L->prev = &mempool.avail[kval];
-			mempool.avail[kval].next = L;		
-			break;
-		}
 
-		buddy->prev->next = buddy->next;
-		buddy->next->prev = buddy->prev;
+void buddy_histograms_reset(void)
+{
+#ifdef BUDDY_INSTRUMENT
+	unsigned long long *word = (unsigned long long *) &histograms;
+	size_t i;
 
-		kval++;
+	for (i = 0; i < sizeof(histograms) / sizeof(*word); i++) {
+		__atomic_store_n(&word[i], 0, __ATOMIC_RELAXED);
+	}
+#endif
+}
 
-		if(buddy < L) {
-			L = buddy;
+
+unsigned long long buddy_histogram_percentile(const struct buddy_histogram *h, double percentile)
+{
+#ifdef BUDDY_INSTRUMENT
+	unsigned long long rank = (unsigned long long) (percentile / 100.0 * h->count + 0.5), seen = 0;
+	int b;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (b = 0; b < BUDDY_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank) {
+			return hist_value(b) < h->max ? hist_value(b) : h->max;
 		}
+	}
+#endif
+	return h->max;
+}
+
 
-		L->kval = kval;
+int buddy_quarantine(size_t bytes)
+{
+#ifdef BUDDY_HARDENED
+	pthread_mutex_lock(&quarantine_lock);
+	__atomic_store_n(&quarantine_limit, bytes, __ATOMIC_RELAXED);
+	while (quarantine_bytes > bytes) {
+		quarantine_evict();
 	}
+	pthread_mutex_unlock(&quarantine_lock);
+	return TRUE;
+#else
+	(void) bytes;
+	errno = ENOSYS;
+	return FALSE;
+#endif
 }
 
 
@@ -305,19 +4062,24 @@ void printBuddyLists()
 
 	// loop through AVAIL[MAX_KVAL]
 	for(i = 0; i <= mempool.lgsize; i++) {
+		order_lock(&mempool, i);
 		printf("List %d: head = %p", i, &mempool.avail[i]);
 
 		struct block_header *curr = mempool.avail[i].next;
 
 		while(curr != &mempool.avail[i]) {
-			if(curr->tag==FREE) {free_blocks++;}
+			struct block_header h;
+
+			h.state = get_state(&mempool, curr);
+			if(h.tag==FREE) {free_blocks++;}
 
-			printf(" --> [tag=%d, kval=%d, addr=%p]", curr->tag, curr->kval, curr->next);
+			printf(" --> [tag=%d, kval=%d, addr=%p]", h.tag, h.kval, curr->next);
 
 			curr = curr->next;
 		}
 
 		printf(" --> <null>\n");
+		order_unlock(&mempool, i);
 	}
 	printf("\n Free Blocks: %d\n", free_blocks);
 }
@@ -10,15 +10,71 @@
 #define TRUE 1
 #define FALSE 0
 
+/* flags for buddy_init_flags() and buddy_arena_create_flags() */
+#define BUDDY_THREADSAFE  0x01 /* lock the shared lists and cache small blocks per thread */
+#define BUDDY_HUGEPAGE    0x02 /* ask for transparent huge pages (MADV_HUGEPAGE) */
+#define BUDDY_HUGETLB     0x04 /* back the pool with 2 MB hugetlbfs pages */
+#define BUDDY_HUGETLB_1GB 0x08 /* back the pool with 1 GB hugetlbfs pages */
+#define BUDDY_GROWABLE    0x10 /* map more chunks of the pool's size when it runs out */
+#define BUDDY_NOHEADER    0x20 /* keep block tags in a side table, not in front of each block */
+#define BUDDY_NOSLAB      0x40 /* serve small requests from the lists instead of slabs */
+#define BUDDY_LAZY        0x80 /* defer merging freed blocks with their buddies */
+
+/* block orders: blocks of 2^k bytes for k < BUDDY_ORDERS */
+#define BUDDY_ORDERS 37
+
+/* prefer NUMA node n for the pool's pages; or it into the flags */
+#define BUDDY_NUMA_NODE(n) ((((n) + 1) & 0xff) << 16)
+#define BUDDY_NUMA_NODE_OF(flags) ((((flags) >> 16) & 0xff) - 1)
+
+
 /**
  * Initialize the buddy system to the given size 
- * (rounded up to the next power of two)
+ * (rounded up to the next power of two). The pool is mapped with mmap and
+ * aligned to its own size.
  *
  * @return  TRUE if successful, ENOMEM otherwise.
  */
 int buddy_init(size_t);
 
 
+/**
+ * Initialize the buddy system like buddy_init(), with BUDDY_* flags. With
+ * BUDDY_THREADSAFE, buddy_malloc/calloc/realloc/free may be called from any
+ * thread; small blocks are served from per-thread caches that refill from and
+ * flush back to the shared lists in batches. It must be called before other
+ * threads use the allocator, as the implicit buddy_init(0) is not thread-safe.
+ * Calling it again replaces the pool: every block of the old one, including
+ * those other threads still cache, is gone, and those caches start over empty
+ * on their thread's next call. No other thread may be inside the allocator
+ * while it runs.
+ * With BUDDY_GROWABLE the pool is the first of up to 64 chunks of the given
+ * size: another chunk is mapped when no block is left, and chunks other than
+ * the first go back to the OS once they are entirely free. A single request
+ * still cannot exceed the chunk size.
+ * With BUDDY_NOHEADER blocks carry no header: a power-of-two request fills
+ * its block exactly and the returned pointer is aligned to the block size.
+ * The tags live in a side table of one byte per 32 bytes of pool instead.
+ * Requests of up to 2 KB are carved from 16 KB slabs of one size class each
+ * unless BUDDY_NOSLAB is given; slots of a power-of-two class are aligned to
+ * their size, the others to 16 bytes.
+ * With BUDDY_LAZY a freed block below 2 MB goes on the list of its size as it
+ * is, so that the next request of that size takes it without splitting a larger
+ * block again. Once 64 such blocks of one size, or 1 MB of them, pile up, or a
+ * request finds no block large enough, the blocks are merged as usual. In a
+ * BUDDY_GROWABLE pool, a block whose merging would leave a chunk entirely free
+ * is merged at once, so that the chunk can go back to the OS.
+ * BUDDY_HUGETLB and BUDDY_HUGETLB_1GB round the pool up to one huge page and
+ * fail with ENOMEM when the system has none reserved; BUDDY_HUGEPAGE and
+ * BUDDY_NUMA_NODE(n) are hints only.
+ *
+ * @param size   Size of the pool (0 for the default)
+ * @param flags  Bitwise or of BUDDY_* flags
+ * @return  TRUE if successful, ENOMEM otherwise.
+ */
+int buddy_init_flags(size_t size, int flags);
+
+
 /**
  * Allocate dynamic memory. Rounds up the requested size to next power of two.
  * Returns a pointer that should be type casted as needed.
@@ -29,7 +85,9 @@ void *buddy_malloc(size_t size);
 
 
 /**
- * Allocate and clear memory to all zeroes. Wrapper function that just calles buddy_malloc.
+ * Allocate and clear memory to all zeroes. Blocks known to be zero already (fresh
+ * pool memory, or large blocks whose pages went back to the OS) are not cleared
+ * again. Fails with ENOMEM if nmemb * size overflows.
  *
  * @param nmemb  The number of members needed
  * @param size   Size of each member
@@ -43,6 +101,8 @@ void *buddy_calloc(size_t nmemb, size_t size);
  * The contents will be unchanged to the minimum of the old and new sizes; newly 
  * allocated memory will be uninitialized. If ptr is NULL, the call is equivalent 
  * to buddy_malloc(size); if size is equal to zero, the call is equivalent to buddy_free(ptr). 
+ * A block grows in place when the buddies above it are free, and shrinks in place
+ * by giving back its upper halves; otherwise the contents move to a new block. 
  * Unless ptr is NULL, it must have been returned by an earlier call to buddy_malloc(), 
  * buddy_calloc() or buddy_realloc().
  *
@@ -57,14 +117,347 @@ void *buddy_realloc(void *ptr, size_t size);
  * buddy_free() frees the memory space pointed to by ptr, which must have been returned 
  * by a previous call to buddy_malloc(), buddy_calloc() or buddy_realloc(). Otherwise, 
  * or if buddy_free(ptr) has already been called before, undefined behaviour occurs. If 
- * ptr is NULL, no operation is performed. 
+ * ptr is NULL, no operation is performed. A libbuddy built with -DBUDDY_HARDENED
+ * instead aborts with a message on stderr for a pointer it did not hand out, a
+ * double free, or a write over the block's header or past the requested size,
+ * as do buddy_realloc(), buddy_free_sized(), buddy_free_batch() and
+ * buddy_usable_size(); see buddy_quarantine().
  * @param ptr Pointer to memory block to be freed
  */
 void buddy_free(void *ptr);
 
 
 /**
- * Prints out all the lists of available blocks in the Buddy system.
+ * buddy_free_sized() is buddy_free() for callers that know the size they asked
+ * for: size must be the one passed to buddy_malloc() or buddy_realloc(), or the
+ * product of buddy_calloc()'s arguments. The block's order then follows from the
+ * size rather than from the header in front of ptr. Pointers from
+ * buddy_memalign() must go to buddy_free(), and so must what buddy_realloc()
+ * returns for them. Built with -DBUDDY_DEBUG, a size that does not match the
+ * block aborts the program, as does such a pointer.
+ * @param ptr Pointer to memory block to be freed
+ * @param size Size requested for the block
+ */
+void buddy_free_sized(void *ptr, size_t size);
+
+
+/**
+ * buddy_malloc_batch() allocates n objects of size bytes each, as n calls to
+ * buddy_malloc() would, and stores them in out[]. Small objects come from one
+ * pass over their size class; larger ones from blocks split off a larger block
+ * in one go instead of one search of the lists each.
+ * @param size Size of each object
+ * @param n Number of objects
+ * @param out Array of n pointers to fill
+ * @return Number of objects allocated, fewer than n if the pool ran out (errno
+ * is then set to ENOMEM)
+ */
+size_t buddy_malloc_batch(size_t size, size_t n, void **out);
+
+
+/**
+ * buddy_free_batch() frees the n pointers in ptrs[], as n calls to buddy_free()
+ * would. Blocks next to each other both in ptrs[] and in memory are combined
+ * with each other before they go back to the lists, so a batch in address order,
+ * like those buddy_malloc_batch() returns, is freed in a single pass. NULL entries
+ * are skipped.
+ * @param ptrs Array of pointers to free
+ * @param n Number of pointers
+ */
+void buddy_free_batch(void **ptrs, size_t n);
+
+
+/**
+ * buddy_memalign() allocates size bytes aligned to alignment, which must be a power
+ * of two. Blocks in the buddy system are aligned to their own size, so the memory
+ * comes from a block large enough to hold an aligned pointer. The result may be
+ * passed to buddy_realloc() and buddy_free() like any other; buddy_realloc() does
+ * not keep the alignment if the block moves.
+ *
+ * @param alignment  Required alignment, a power of two
+ * @param size       The amount of memory requested
+ * @return Pointer to the aligned memory, or NULL with errno set to EINVAL for a
+ *         bad alignment or ENOMEM.
+ */
+void *buddy_memalign(size_t alignment, size_t size);
+
+
+/**
+ * buddy_posix_memalign() stores in *memptr the result of buddy_memalign(alignment, size),
+ * where alignment must also be a multiple of sizeof(void *).
+ *
+ * @return 0 if successful, EINVAL or ENOMEM otherwise.
+ */
+int buddy_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+
+/**
+ * buddy_aligned_alloc() is buddy_memalign() under its C11 name.
+ */
+void *buddy_aligned_alloc(size_t alignment, size_t size);
+
+
+/**
+ * buddy_background_start() starts a worker thread for the default arena, which
+ * must have been initialized with BUDDY_THREADSAFE. While it runs, buddy_free()
+ * only queues a block that would have to be merged with its buddies; the worker
+ * does the merging, and hands the pages of free blocks of 2 MB or more back to
+ * the OS, in passes of at most budget blocks every interval_ms milliseconds. A
+ * request that finds no block large enough merges the queue itself. Calling it
+ * again while the worker runs changes the budget and interval.
+ * @param budget Blocks merged per pass, 0 for no limit
+ * @param interval_ms Milliseconds between passes
+ * @return TRUE if the worker runs, FALSE with errno set otherwise
+ */
+int buddy_background_start(size_t budget, unsigned int interval_ms);
+
+
+/**
+ * buddy_background_stop() stops the default arena's worker thread, if it runs,
+ * and merges the blocks it left queued. Blocks freed by other threads while it
+ * stops are merged by the next request that runs short.
+ */
+void buddy_background_stop(void);
+
+
+/* a snapshot of an arena for buddy_stats() */
+struct buddy_stats {
+	size_t pool_bytes;      /* mapped for the pool, every chunk of a growable one */
+	size_t free_bytes;      /* in blocks on the free lists */
+	size_t largest_free;    /* size of the largest free block, 0 if none */
+	size_t free_blocks[BUDDY_ORDERS]; /* free blocks of 2^k bytes */
+	size_t slab_bytes;      /* in slabs; the rest of pool_bytes - free_bytes is in blocks */
+	size_t slab_free_bytes; /* in slots of those not handed out */
+	unsigned long long mallocs; /* allocations, including each of a batch and those moved by realloc */
+	unsigned long long frees;   /* frees, likewise */
+	unsigned long long splits;  /* blocks split in two */
+	unsigned long long merges;  /* pairs of buddies combined */
+	unsigned long long requested_bytes; /* asked for by every allocation counted in mallocs */
+	unsigned long long reserved_bytes;  /* of the blocks and slots handed out for them */
+	double internal_fragmentation;      /* 1 - requested_bytes / reserved_bytes */
+};
+
+
+/**
+ * buddy_stats() fills stats with the state of the default arena and its call
+ * counters since it was initialized. The counters are kept up to date as calls
+ * go, per thread and per free list, so a snapshot costs one pass over the orders
+ * and size classes and one over the threads. It locks nothing the allocation
+ * paths take, so counts may be a few calls apart from each other. Blocks held
+ * in thread caches or queued for the background worker count as in use.
+ * @param stats Structure to fill
+ */
+void buddy_stats(struct buddy_stats *stats);
+
+
+/* version of the buddy_dump_map() stream, and the states of its runs */
+#define BUDDY_MAP_VERSION  1
+#define BUDDY_MAP_FREE     0 /* on a free list */
+#define BUDDY_MAP_RESERVED 1 /* handed out, cached by a thread or queued for the worker */
+#define BUDDY_MAP_SLAB     2 /* a slab of small slots, whether in use or not */
+#define BUDDY_MAP_LAZY     3 /* free, not merged with its buddy yet (BUDDY_LAZY) */
+
+
+/**
+ * buddy_dump_map() writes a map of the default arena's pool to fd: every block
+ * in address order, as runs of blocks of one state and order. The stream is a
+ * 24-byte header:
+ *   "BMAP", version, chunk order, minimum order, page order (a byte each),
+ *   flags (4 bytes), number of chunks that follow (4), pool start (8)
+ * then for each mapped chunk its index (4 bytes) and runs covering exactly
+ * 2^(chunk order) bytes, each a byte of state << 6 | order followed by the
+ * number of blocks as an LEB128 varint. Numbers are little-endian. About a byte
+ * or two per run of blocks, so a map of a multi-GB pool stays small; see
+ * buddy-mapview for reading one. The pool is locked while the map is written,
+ * so fd should not block for long, and must not be a pipe read by a thread
+ * of the same process that allocates from the arena.
+ * @param fd File descriptor to write to
+ * @return TRUE, or FALSE with errno set by write(), to EIO for a corrupt
+ *         header, or to EINVAL before the arena is initialized.
+ */
+int buddy_dump_map(int fd);
+
+
+/**
+ * buddy_profile_start() starts sampling buddy_malloc and buddy_calloc calls
+ * of every arena for a heap profile: about one per rate bytes allocated, with
+ * each byte equally likely, the stack of the call is recorded with the block
+ * until it is freed. Calls that do not sample cost a thread-local countdown;
+ * frees of unsampled memory a flag test. A sampled request is given a block of
+ * its own even if it would fit a slab. Resizing a sampled block in place by
+ * buddy_realloc drops its sample. Calling it again changes the rate and keeps
+ * the samples taken so far.
+ * @param rate Mean bytes allocated between samples, 0 for 512 KB
+ * @return TRUE
+ */
+int buddy_profile_start(size_t rate);
+
+
+/**
+ * buddy_profile_stop() stops taking samples. Those taken stay in the profile
+ * until their memory is freed.
+ */
+void buddy_profile_stop(void);
+
+
+/**
+ * buddy_profile_dump() writes the profile of the sampled memory to fd in the
+ * legacy heap format of gperftools ("heap_v2"), which pprof reads and scales
+ * by the sampling rate: the live and the total allocations of each call
+ * stack, followed by the mappings of the process for symbolizing them, e.g.
+ *   pprof --inuse_space program heap.prof
+ * Sampling waits while the profile is being written.
+ * @param fd File descriptor to write to
+ * @return TRUE, or FALSE with errno set by write() or read().
+ */
+int buddy_profile_dump(int fd);
+
+
+/* buckets of a histogram: a bucket per value below 16, then 16 per power of two */
+#define BUDDY_HIST_BUCKETS 976
+
+/* values recorded by a build with -DBUDDY_INSTRUMENT, see buddy_histograms_get() */
+struct buddy_histogram {
+	unsigned long long count; /* values recorded */
+	unsigned long long max;   /* the largest of them */
+	unsigned long long buckets[BUDDY_HIST_BUCKETS]; /* values within 1/16 of each other share one */
+};
+
+struct buddy_histograms {
+	struct buddy_histogram malloc_cycles; /* cycles per buddy_malloc call */
+	struct buddy_histogram free_cycles;   /* cycles per buddy_free or buddy_free_sized call */
+	struct buddy_histogram malloc_splits; /* blocks split per buddy_malloc call */
+	struct buddy_histogram free_merges;   /* buddies merged per buddy_free call */
+};
+
+
+/**
+ * buddy_histograms_get() copies the histograms of a libbuddy built with
+ * -DBUDDY_INSTRUMENT into h (some 30 KB, better not on a small stack). Every
+ * buddy_malloc, buddy_free and buddy_free_sized call, on any arena, records the
+ * cycles it took (time stamp counter ticks on x86 and arm64, nanoseconds
+ * elsewhere) and the splits or merges it did, including those of the batch a
+ * thread cache moved for it. Calls through calloc, realloc, memalign and the
+ * batch functions are not recorded. Such a build also fires the USDT probes
+ * buddy:malloc, buddy:free, buddy:split and buddy:merge where <sys/sdt.h> is
+ * available; other builds record nothing and pay nothing.
+ * @param h Histograms to fill
+ * @return TRUE, or FALSE with errno set to ENOSYS and h zeroed if not built
+ *         with -DBUDDY_INSTRUMENT.
+ */
+int buddy_histograms_get(struct buddy_histograms *h);
+
+
+/**
+ * buddy_histograms_reset() empties the histograms; calls under way while it
+ * runs may be recorded or not.
+ */
+void buddy_histograms_reset(void);
+
+
+/**
+ * buddy_histogram_percentile() returns the value below or at which the given
+ * percentage of h's values fall, to within 1/16, and never more than h->max.
+ * @param h           Histogram from buddy_histograms_get()
+ * @param percentile  Percentage, from 0 to 100
+ * @return The value, 0 if h is empty.
+ */
+unsigned long long buddy_histogram_percentile(const struct buddy_histogram *h, double percentile);
+
+
+/**
+ * buddy_quarantine() sets how many bytes of freed memory a libbuddy built with
+ * -DBUDDY_HARDENED holds back before reusing it, for every arena. Such a build
+ * records the size of each request and whether it was freed, for a slot in a
+ * table in front of its slab's slots, for a block in its header or, in a
+ * BUDDY_NOHEADER pool, in a trailer at its end, and checks guard bytes right
+ * after the requested size: up to 8 in what a slot leaves, 8 that a block is
+ * padded by. Memory in the quarantine is filled with 0xdf, and a write to it
+ * through a dangling pointer aborts once it leaves, which it does oldest first.
+ * Frees then take a lock shared by all threads.
+ * @param bytes Bytes to hold back, 0 to free what is held and turn it off
+ * @return TRUE, or FALSE with errno set to ENOSYS if not built with
+ *         -DBUDDY_HARDENED.
+ */
+int buddy_quarantine(size_t bytes);
+
+
+/**
+ * buddy_usable_size() returns the number of bytes usable at ptr, which must have
+ * been returned by buddy_malloc(), buddy_calloc() or buddy_realloc(): the size of
+ * its slot or block, which is at least the size requested. Returns 0 for NULL.
+ * With -DBUDDY_HARDENED it is the size requested, as the rest is guarded.
+ * @param ptr Pointer to an allocated memory block
+ * @return Usable size of the block
+ */
+size_t buddy_usable_size(void *ptr);
+
+
+/**
+ * An arena is an independent buddy system with its own pool and lists. Memory
+ * from one arena must be freed and reallocated through the same arena, and
+ * buddy_arena_destroy() releases the whole pool at once. The buddy_* functions
+ * above operate on a default arena that is never destroyed. Only the default
+ * arena uses the per-thread caches of BUDDY_THREADSAFE.
+ */
+typedef struct buddy_arena buddy_arena_t;
+
+
+/**
+ * Create an arena with a pool of the given size (rounded up to the next power
+ * of two, 0 for the default size).
+ *
+ * @param size  Size of the arena's pool
+ * @return The new arena, or NULL with errno set to ENOMEM.
+ */
+buddy_arena_t *buddy_arena_create(size_t size);
+
+
+/**
+ * Create an arena like buddy_arena_create(), with BUDDY_* flags.
+ *
+ * @param size   Size of the arena's pool
+ * @param flags  Bitwise or of BUDDY_* flags
+ * @return The new arena, or NULL with errno set to ENOMEM.
+ */
+buddy_arena_t *buddy_arena_create_flags(size_t size, int flags);
+
+
+/**
+ * Destroy an arena, returning its whole pool to the OS. Every pointer obtained
+ * from the arena becomes invalid.
+ *
+ * @param arena  Arena to destroy
+ */
+void buddy_arena_destroy(buddy_arena_t *arena);
+
+
+/**
+ * buddy_malloc(), buddy_calloc(), buddy_realloc(), buddy_free(), buddy_free_sized(),
+ * buddy_malloc_batch(), buddy_free_batch(), buddy_memalign(), buddy_usable_size(),
+ * buddy_background_start(), buddy_background_stop(), buddy_stats() and
+ * buddy_dump_map() on the given arena.
+ * buddy_arena_destroy() stops the arena's worker thread first.
+ */
+void *buddy_arena_malloc(buddy_arena_t *arena, size_t size);
+void *buddy_arena_calloc(buddy_arena_t *arena, size_t nmemb, size_t size);
+void *buddy_arena_realloc(buddy_arena_t *arena, void *ptr, size_t size);
+void buddy_arena_free(buddy_arena_t *arena, void *ptr);
+void buddy_arena_free_sized(buddy_arena_t *arena, void *ptr, size_t size);
+size_t buddy_arena_malloc_batch(buddy_arena_t *arena, size_t size, size_t n, void **out);
+void buddy_arena_free_batch(buddy_arena_t *arena, void **ptrs, size_t n);
+void *buddy_arena_memalign(buddy_arena_t *arena, size_t alignment, size_t size);
+size_t buddy_arena_usable_size(buddy_arena_t *arena, void *ptr);
+int buddy_arena_background_start(buddy_arena_t *arena, size_t budget, unsigned int interval_ms);
+void buddy_arena_background_stop(buddy_arena_t *arena);
+void buddy_arena_stats(buddy_arena_t *arena, struct buddy_stats *stats);
+int buddy_arena_dump_map(buddy_arena_t *arena, int fd);
+
+
+/**
+ * Prints out all the lists of available blocks in the Buddy system, one line
+ * per order and an entry per free block, with the free lists locked; for
+ * debugging. buddy_stats() has the totals, buddy_dump_map() a map of the pool.
  */
 void printBuddyLists(void);
 
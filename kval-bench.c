@@ -0,0 +1,118 @@
+/**
+ * Microbenchmark for the kval (log2 ceiling) computation used by buddy_malloc
+ * and buddy_realloc. Compares the original one-bit-per-iteration shift loop
+ * against the leading-zero-count version in kval.h, for every order from 0 to
+ * 36 (sizes 0 .. 2^36) and for a log-uniform mix of sizes across that range.
+ *
+ * Usage: kval-bench [rounds]
+ *
+ * @author Wyatt Cupp
+ *
+ */
+
+#include "kval.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MAX_ORDER 36
+#define NSIZES 4096
+
+/* sizes folded at compile time; the array bound only compiles if KVAL_CONST is constant */
+static const unsigned char folded[] = {
+	KVAL_CONST(0), KVAL_CONST(1), KVAL_CONST(24), KVAL_CONST(4096),
+	KVAL_CONST(512*1024*1024), KVAL_CONST(UINT64_C(1) << 36)
+};
+static char folded_check[KVAL_CONST(4097) == 13 ? 1 : -1];
+
+static volatile unsigned long sink;
+
+/* the shift loop buddy.c used before kval.h */
+static unsigned short int loop_kval(size_t size) {
+	size_t kval = 1;
+	size_t curr = 1;
+	while (curr<size) {
+		curr <<= 1;
+		kval++;
+	}
+
+	return kval-1;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* returns ns per call of fn over sizes[], repeated rounds times */
+static double time_kval(unsigned short int (*fn)(size_t), const size_t *sizes, int rounds) {
+	unsigned long acc = 0;
+	double t0 = now();
+	int r, i;
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < NSIZES; i++) {
+			acc += fn(sizes[i]);
+		}
+	}
+	sink = acc;
+	return (now() - t0) * 1e9 / ((double) rounds * NSIZES);
+}
+
+/* random size in (2^(k-1), 2^k], or 0..1 for order 0 */
+static size_t size_in_order(int k) {
+	size_t lo, span;
+
+	if (k == 0) {
+		return rand() & 1;
+	}
+	lo = (size_t) 1 << (k - 1);
+	span = lo;
+	return lo + 1 + (((size_t) rand() << 16 ^ rand()) % span);
+}
+
+int main(int argc, char *argv[]) {
+	static size_t sizes[NSIZES];
+	int rounds = argc > 1 ? atoi(argv[1]) : 200;
+	double loop_ns, clz_ns, loop_total = 0, clz_total = 0;
+	int k, i;
+
+	(void) folded_check;
+	srand(42);
+
+	printf("folded at compile time:");
+	for (i = 0; i < (int) sizeof(folded); i++) {
+		printf(" %d", folded[i]);
+	}
+	printf("\n\n%5s %14s %14s %9s\n", "order", "loop ns/call", "clz ns/call", "speedup");
+
+	for (k = 0; k <= MAX_ORDER; k++) {
+		for (i = 0; i < NSIZES; i++) {
+			sizes[i] = size_in_order(k);
+			if (loop_kval(sizes[i]) != kval_of(sizes[i])) {
+				fprintf(stderr, "mismatch for size %zu: %d != %d\n", sizes[i],
+					loop_kval(sizes[i]), kval_of(sizes[i]));
+				return 1;
+			}
+		}
+		loop_ns = time_kval(loop_kval, sizes, rounds);
+		clz_ns = time_kval(kval_of, sizes, rounds);
+		loop_total += loop_ns;
+		clz_total += clz_ns;
+		printf("%5d %14.2f %14.2f %8.1fx\n", k, loop_ns, clz_ns, loop_ns / clz_ns);
+	}
+
+	/* log-uniform mix across the whole range, so the loop's branch can't be predicted */
+	for (i = 0; i < NSIZES; i++) {
+		sizes[i] = size_in_order(rand() % (MAX_ORDER + 1));
+	}
+	loop_ns = time_kval(loop_kval, sizes, rounds);
+	clz_ns = time_kval(kval_of, sizes, rounds);
+	printf("%5s %14.2f %14.2f %8.1fx\n", "mixed", loop_ns, clz_ns, loop_ns / clz_ns);
+	printf("%5s %14.2f %14.2f %8.1fx\n", "mean", loop_total / (MAX_ORDER + 1),
+		clz_total / (MAX_ORDER + 1), loop_total / clz_total);
+
+	return 0;
+}
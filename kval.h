@@ -0,0 +1,42 @@
+#ifndef KVAL_H_
+#define KVAL_H_
+
+#include <stddef.h>
+#include <limits.h>
+
+/*
+ * floor(log2(x)) of a non-zero constant, written as a binary search on the
+ * bit position so the whole expression stays an integer constant expression.
+ */
+#define KVAL_LG2_2(x)  (((x) & 0x2) ? 1 : 0)
+#define KVAL_LG2_4(x)  (((x) & 0xC) ? 2 + KVAL_LG2_2((x) >> 2) : KVAL_LG2_2(x))
+#define KVAL_LG2_8(x)  (((x) & 0xF0) ? 4 + KVAL_LG2_4((x) >> 4) : KVAL_LG2_4(x))
+#define KVAL_LG2_16(x) (((x) & 0xFF00) ? 8 + KVAL_LG2_8((x) >> 8) : KVAL_LG2_8(x))
+#define KVAL_LG2_32(x) (((x) & 0xFFFF0000UL) ? 16 + KVAL_LG2_16((x) >> 16) : KVAL_LG2_16(x))
+#define KVAL_LG2_64(x) (((x) & 0xFFFFFFFF00000000ULL) ? 32 + KVAL_LG2_32((x) >> 32) : KVAL_LG2_32(x))
+
+/**
+ * Compile-time kval: the log2 ceiling of a constant size, folded by the
+ * preprocessor and compiler. Usable in static initializers and array bounds.
+ */
+#define KVAL_CONST(size) \
+	((unsigned long long) (size) <= 1 ? 0 : 1 + KVAL_LG2_64((unsigned long long) (size) - 1))
+
+
+/**
+ *  Gets the Log2 (kval) of given raw size, i.e. the smallest k with 2^k >= size.
+ *  Counts the leading zeros of size-1 instead of shifting one bit at a time.
+ */
+static __inline__ unsigned short int kval_of(size_t size) {
+	if (size <= 1) {
+		return 0;
+	}
+	return (unsigned short int) (sizeof(unsigned long long) * CHAR_BIT
+		- __builtin_clzll((unsigned long long) size - 1));
+}
+
+/* constant request sizes fold to KVAL_CONST, everything else takes the clz path */
+#define get_kval(size) \
+	(__builtin_constant_p(size) ? (unsigned short int) KVAL_CONST(size) : kval_of(size))
+
+#endif /*KVAL_H_*/